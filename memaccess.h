@@ -0,0 +1,445 @@
+/*
+ * memaccess.h
+ *
+ * Width specialized copy and compare kernels for device memory,
+ * shared by memtool and memtest
+ *
+ * Each kernel moves data with exactly one load or store instruction of the
+ * selected width per element, in address order, through volatile pointers
+ * or volatile asm, so the compiler can neither merge, split, reorder nor
+ * drop accesses. What the CPU turns that into on the bus is still up to
+ * the memory type of the mapping, but for uncached BAR mappings one access
+ * gives one TLP of that size. Pick the kernels once with memaccess_init()
+ * and call them through struct memaccess outside of any per element switch.
+ *
+ * Widths of 1, 2, 4 and 8 bytes are always available, 16 bytes needs SSE2
+ * (SSSE3 for byte swapping) and 32 bytes needs AVX2. The SSSE3 and AVX2
+ * kernels are built for their target regardless of the compiler flags and
+ * only picked if the CPU has the extension. Lengths are in bytes
+ * and rounded down to a multiple of the width, the caller has to align
+ * addresses to the width for 16 and 32 byte accesses.
+ */
+
+#ifndef _MEMACCESS_H
+#define _MEMACCESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#include <cpuid.h>
+
+#define MA_SSSE3	__attribute__((target("ssse3")))
+#define MA_SSE41	__attribute__((target("sse4.1")))
+#define MA_AVX2		__attribute__((target("avx2")))
+#endif
+
+typedef void (*memaccess_copy_t)(volatile void *dst, const volatile void *src,
+				 size_t n);
+typedef size_t (*memaccess_cmp_t)(const volatile void *a,
+				  const volatile void *b, size_t n);
+
+struct memaccess {
+	unsigned int width;	/* bytes per access */
+	unsigned int swab;	/* bytes per swapped element, 0 for none */
+	memaccess_copy_t copy;	/* copy, byte swapping if swab is set */
+	memaccess_cmp_t cmp;	/* offset of the first mismatch, or n */
+};
+
+#define MA_SCALAR(bits)							\
+static inline void ma_copy##bits(volatile void *dst,			\
+				 const volatile void *src, size_t n)	\
+{									\
+	volatile uint##bits##_t *d = dst;				\
+	const volatile uint##bits##_t *s = src;				\
+	size_t i;							\
+									\
+	for (i = 0; i < n / sizeof(*d); i++)				\
+		d[i] = s[i];						\
+}									\
+									\
+static inline size_t ma_cmp##bits(const volatile void *a,		\
+				  const volatile void *b, size_t n)	\
+{									\
+	const volatile uint##bits##_t *x = a, *y = b;			\
+	size_t i;							\
+									\
+	for (i = 0; i < n / sizeof(*x); i++)				\
+		if (x[i] != y[i])					\
+			return i * sizeof(*x);				\
+	return n;							\
+}
+
+#define MA_SCALAR_SWAB(bits)						\
+static inline void ma_copy##bits##_swab(volatile void *dst,		\
+					const volatile void *src,	\
+					size_t n)			\
+{									\
+	volatile uint##bits##_t *d = dst;				\
+	const volatile uint##bits##_t *s = src;				\
+	size_t i;							\
+									\
+	for (i = 0; i < n / sizeof(*d); i++)				\
+		d[i] = __builtin_bswap##bits(s[i]);			\
+}
+
+MA_SCALAR(8)
+MA_SCALAR(16)
+MA_SCALAR(32)
+MA_SCALAR(64)
+MA_SCALAR_SWAB(16)
+MA_SCALAR_SWAB(32)
+MA_SCALAR_SWAB(64)
+
+/* vector byte swap masks, each 128 bit lane is shuffled the same way */
+static const uint8_t ma_swab_mask[3][16] __attribute__((aligned(16))) = {
+	{ 1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14 },
+	{ 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12 },
+	{ 7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8 },
+};
+
+#define MA_SWAB_IDX(swab)	((swab) == 2 ? 0 : (swab) == 4 ? 1 : 2)
+
+#if defined(__SSE2__)
+static inline __m128i ma_ld128(const volatile void *p)
+{
+	__m128i v;
+
+	__asm__ __volatile__("movdqa %1, %0"
+			     : "=x" (v) : "m" (*(const __m128i *)(uintptr_t)p));
+	return v;
+}
+
+static inline void ma_st128(volatile void *p, __m128i v)
+{
+	__asm__ __volatile__("movdqa %1, %0"
+			     : "=m" (*(__m128i *)(uintptr_t)p) : "x" (v));
+}
+
+static inline void ma_copy128(volatile void *dst, const volatile void *src,
+			      size_t n)
+{
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16)
+		ma_st128((volatile char *)dst + i,
+			 ma_ld128((const volatile char *)src + i));
+}
+
+static inline size_t ma_cmp128(const volatile void *a, const volatile void *b,
+			       size_t n)
+{
+	__m128i x, y;
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		x = ma_ld128((const volatile char *)a + i);
+		y = ma_ld128((const volatile char *)b + i);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) != 0xffff)
+			return i;
+	}
+	return n;
+}
+
+/*
+ * Non-temporal variants, the stores bypass the caches. movntdqa only
+ * streams from write combining memory and acts as a normal load elsewhere,
+ * it needs SSE4.1.
+ */
+static inline void ma_copy128_nt(volatile void *dst, const volatile void *src,
+				 size_t n)
+{
+	__m128i v;
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		v = ma_ld128((const volatile char *)src + i);
+		__asm__ __volatile__("movntdq %1, %0"
+				     : "=m" (*(__m128i *)(uintptr_t)
+					     ((volatile char *)dst + i))
+				     : "x" (v));
+	}
+	_mm_sfence();
+}
+
+MA_SSE41
+static inline void ma_copy128_ntdqa(volatile void *dst,
+				    const volatile void *src, size_t n)
+{
+	__m128i v;
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		__asm__ __volatile__("movntdqa %1, %0" : "=x" (v)
+				     : "m" (*(const __m128i *)(uintptr_t)
+					    ((const volatile char *)src + i)));
+		__asm__ __volatile__("movntdq %1, %0"
+				     : "=m" (*(__m128i *)(uintptr_t)
+					     ((volatile char *)dst + i))
+				     : "x" (v));
+	}
+	_mm_sfence();
+}
+
+#define MA_SWAB128(swab)						\
+MA_SSSE3								\
+static inline void ma_copy128_swab##swab(volatile void *dst,		\
+					 const volatile void *src,	\
+					 size_t n)			\
+{									\
+	const __m128i mask =						\
+		_mm_load_si128((const __m128i *)			\
+			       ma_swab_mask[MA_SWAB_IDX(swab)]);	\
+	size_t i;							\
+									\
+	for (i = 0; i + 16 <= n; i += 16)				\
+		ma_st128((volatile char *)dst + i,			\
+			 _mm_shuffle_epi8(ma_ld128((const volatile char *)src + i), \
+					  mask));			\
+}
+
+MA_SWAB128(2)
+MA_SWAB128(4)
+MA_SWAB128(8)
+
+MA_AVX2
+static inline __m256i ma_ld256(const volatile void *p)
+{
+	__m256i v;
+
+	__asm__ __volatile__("vmovdqa %1, %0"
+			     : "=x" (v) : "m" (*(const __m256i *)(uintptr_t)p));
+	return v;
+}
+
+MA_AVX2
+static inline void ma_st256(volatile void *p, __m256i v)
+{
+	__asm__ __volatile__("vmovdqa %1, %0"
+			     : "=m" (*(__m256i *)(uintptr_t)p) : "x" (v));
+}
+
+MA_AVX2
+static inline void ma_copy256(volatile void *dst, const volatile void *src,
+			      size_t n)
+{
+	size_t i;
+
+	for (i = 0; i + 32 <= n; i += 32)
+		ma_st256((volatile char *)dst + i,
+			 ma_ld256((const volatile char *)src + i));
+}
+
+MA_AVX2
+static inline size_t ma_cmp256(const volatile void *a, const volatile void *b,
+			       size_t n)
+{
+	__m256i x, y;
+	size_t i;
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		x = ma_ld256((const volatile char *)a + i);
+		y = ma_ld256((const volatile char *)b + i);
+		if ((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)) !=
+		    0xffffffff)
+			return i;
+	}
+	return n;
+}
+
+MA_AVX2
+static inline void ma_copy256_nt(volatile void *dst, const volatile void *src,
+				 size_t n)
+{
+	__m256i v;
+	size_t i;
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		__asm__ __volatile__("vmovntdqa %1, %0" : "=x" (v)
+				     : "m" (*(const __m256i *)(uintptr_t)
+					    ((const volatile char *)src + i)));
+		__asm__ __volatile__("vmovntdq %1, %0"
+				     : "=m" (*(__m256i *)(uintptr_t)
+					     ((volatile char *)dst + i))
+				     : "x" (v));
+	}
+	_mm_sfence();
+}
+
+#define MA_SWAB256(swab)						\
+MA_AVX2									\
+static inline void ma_copy256_swab##swab(volatile void *dst,		\
+					 const volatile void *src,	\
+					 size_t n)			\
+{									\
+	const __m256i mask =						\
+		_mm256_broadcastsi128_si256(				\
+			_mm_load_si128((const __m128i *)		\
+				       ma_swab_mask[MA_SWAB_IDX(swab)])); \
+	size_t i;							\
+									\
+	for (i = 0; i + 32 <= n; i += 32)				\
+		ma_st256((volatile char *)dst + i,			\
+			 _mm256_shuffle_epi8(ma_ld256((const volatile char *)src + i), \
+					     mask));			\
+}
+
+MA_SWAB256(2)
+MA_SWAB256(4)
+MA_SWAB256(8)
+#endif /* __SSE2__ */
+
+/*
+ * Select the kernels for accesses of width bytes. If swab is non zero
+ * copies swap the bytes of each swab sized element, swab must not be
+ * larger than 8 or width. Returns -1 if the combination is not supported
+ * by this build or CPU.
+ */
+static inline int memaccess_init(struct memaccess *ma, unsigned int width,
+				 unsigned int swab)
+{
+	memset(ma, 0, sizeof(*ma));
+
+	if (swab == 1)
+		swab = 0;
+	if (swab && (swab > 8 || swab > width || (swab & (swab - 1))))
+		return -1;
+
+	ma->width = width;
+	ma->swab = swab;
+
+	switch (width) {
+	case 1:
+		ma->copy = ma_copy8;
+		ma->cmp = ma_cmp8;
+		return 0;
+	case 2:
+		ma->copy = swab ? ma_copy16_swab : ma_copy16;
+		ma->cmp = ma_cmp16;
+		return 0;
+	case 4:
+		ma->copy = swab ? ma_copy32_swab : ma_copy32;
+		ma->cmp = ma_cmp32;
+		if (swab && swab != 4)
+			return -1;
+		return 0;
+	case 8:
+		ma->copy = swab ? ma_copy64_swab : ma_copy64;
+		ma->cmp = ma_cmp64;
+		if (swab && swab != 8)
+			return -1;
+		return 0;
+#if defined(__SSE2__)
+	case 16:
+		ma->cmp = ma_cmp128;
+		if (!swab) {
+			ma->copy = ma_copy128;
+			return 0;
+		}
+		if (!__builtin_cpu_supports("ssse3"))
+			return -1;
+		switch (swab) {
+		case 2:
+			ma->copy = ma_copy128_swab2;
+			return 0;
+		case 4:
+			ma->copy = ma_copy128_swab4;
+			return 0;
+		case 8:
+			ma->copy = ma_copy128_swab8;
+			return 0;
+		}
+		return -1;
+	case 32:
+		if (!__builtin_cpu_supports("avx2"))
+			return -1;
+		ma->cmp = ma_cmp256;
+		switch (swab) {
+		case 0:
+			ma->copy = ma_copy256;
+			return 0;
+		case 2:
+			ma->copy = ma_copy256_swab2;
+			return 0;
+		case 4:
+			ma->copy = ma_copy256_swab4;
+			return 0;
+		case 8:
+			ma->copy = ma_copy256_swab8;
+			return 0;
+		}
+		return -1;
+#endif
+	}
+
+	return -1;
+}
+
+/*
+ * Switch copy to non-temporal accesses. Only available for
+ * unswapped 16 and 32 byte accesses, returns -1 otherwise.
+ */
+static inline int memaccess_set_nt(struct memaccess *ma)
+{
+	if (ma->swab)
+		return -1;
+
+	switch (ma->width) {
+#if defined(__SSE2__)
+	case 16:
+		ma->copy = __builtin_cpu_supports("sse4.1") ?
+			   ma_copy128_ntdqa : ma_copy128_nt;
+		return 0;
+	case 32:
+		ma->copy = ma_copy256_nt;
+		return 0;
+#endif
+	}
+
+	return -1;
+}
+
+/*
+ * Write back and invalidate the cache lines covering [addr, addr + n),
+ * with clflushopt if the CPU has it and clflush otherwise. Returns the
+ * name of the instruction used, or NULL if this build cannot flush.
+ */
+static inline const char *memaccess_flush(const volatile void *addr, size_t n)
+{
+#if defined(__SSE2__)
+	static int has_clflushopt = -1;
+	const volatile char *p, *end = (const volatile char *)addr + n;
+	unsigned int eax, ebx, ecx, edx;
+	long line = sysconf(_SC_LEVEL1_DCACHE_LINESIZE);
+
+	if (line <= 0)
+		line = 64;
+
+	if (has_clflushopt < 0)
+		has_clflushopt = __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) &&
+				 (ebx & bit_CLFLUSHOPT);
+
+	p = (const volatile char *)((uintptr_t)addr & ~(uintptr_t)(line - 1));
+	_mm_mfence();
+	if (has_clflushopt) {
+		/* clflushopt is clflush with a 0x66 prefix */
+		for (; p < end; p += line)
+			__asm__ __volatile__(".byte 0x66; clflush %0"
+					     : "+m" (*(volatile char *)p));
+	} else {
+		for (; p < end; p += line)
+			__asm__ __volatile__("clflush %0"
+					     : "+m" (*(volatile char *)p));
+	}
+	_mm_mfence();
+
+	return has_clflushopt ? "clflushopt" : "clflush";
+#else
+	return NULL;
+#endif
+}
+
+#endif /* _MEMACCESS_H */
@@ -8,9 +8,12 @@
 #include <sys/time.h>
 #include <time.h>
 #include <fcntl.h>
+#include <getopt.h>
+
+#include "memaccess.h"
 
 #define BLOCK_SIZE	16384
-static char buf[BLOCK_SIZE];
+static char buf[BLOCK_SIZE] __attribute__((aligned(32)));
 
 static double time_sub_us(struct timespec *new, struct timespec *old)
 {
@@ -19,9 +22,90 @@ static double time_sub_us(struct timespec *new, struct timespec *old)
 	return (b - a);
 }
 
+/*
+ * One pass copies total bytes from src to dst in BLOCK_SIZE chunks,
+ * wrapping around in either buffer when it is smaller than total. A cold
+ * pass flushes the source again on each wrap with the clock stopped, so
+ * every lap reads it from memory.
+ */
+struct pass {
+	const struct memaccess *ma;
+	char *src;
+	size_t src_size;
+	char *dst;
+	size_t dst_size;
+	size_t total;
+	size_t dst_off;
+};
+
+/* returns the speed in M/s */
+static double run_pass(struct pass *p, int cold)
+{
+	struct timespec old, new;
+	size_t done, n, src_off = 0;
+	double us = 0.0;
+
+	clock_gettime(CLOCK_MONOTONIC, &old);
+	for (done = 0; done < p->total; done += n) {
+		n = p->total - done;
+		if (n > BLOCK_SIZE)
+			n = BLOCK_SIZE;
+		if (n > p->src_size)
+			n = p->src_size;
+		if (n > p->dst_size)
+			n = p->dst_size;
+		if (src_off + n > p->src_size) {
+			src_off = 0;
+			if (cold) {
+				clock_gettime(CLOCK_MONOTONIC, &new);
+				us += time_sub_us(&new, &old);
+				memaccess_flush(p->src, p->src_size);
+				clock_gettime(CLOCK_MONOTONIC, &old);
+			}
+		}
+		if (p->dst_off + n > p->dst_size)
+			p->dst_off = 0;
+		p->ma->copy(p->dst + p->dst_off, p->src + src_off, n);
+		src_off += n;
+		p->dst_off += n;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &new);
+	us += time_sub_us(&new, &old);
+
+	return (double)p->total / us / 1.048576;
+}
+
+static size_t llc_size(void)
+{
+	long size = sysconf(_SC_LEVEL3_CACHE_SIZE);
+
+	if (size <= 0)
+		size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+	return size > 0 ? size : 32 << 20;
+}
+
+static void usage(const char *name)
+{
+	printf("Usage:\n");
+	printf("\t%s [OPTIONS] fill MemAddr MemSize TestPattern\n", name);
+	printf("\t%s [OPTIONS] read MemAddr MemSize TestTotalSize\n", name);
+	printf("Options:\n");
+	printf("\t-w BITS  access width, 8 to 256 bits (default 32)\n");
+	printf("\t-i N     number of cold/warm pass pairs (default 1)\n");
+	printf("\t-n       non-temporal loads and stores (128/256 bit only),\n");
+	printf("\t         the loads only stream from write combining memory\n");
+	printf("\t         and are ordinary cached loads from normal RAM\n");
+	printf("\t-r       rotate reads through destination buffers of twice\n");
+	printf("\t         the LLC size instead of one %d byte buffer\n",
+	       BLOCK_SIZE);
+	printf("Each cold pass is preceded by flushing source and destination\n");
+	printf("from the caches and flushes the source again whenever it\n");
+	printf("wraps around, the warm pass repeats it right after.\n");
+}
+
 int main(int argc, char **argv)
 {
-	int i, j;
+	int i, opt;
 	int fd;
 	char *mem;
 	int write = 0;
@@ -29,16 +113,53 @@ int main(int argc, char **argv)
 	unsigned int mem_size = BLOCK_SIZE;
 	unsigned int test_pattern = 0x12345a5a;
 	unsigned int test_size = BLOCK_SIZE;
-	struct timespec old, new;
-	double speed = 0.0;
+	unsigned int *pattern = NULL;
+	struct memaccess ma;
+	struct pass pass;
+	const char *flush;
+	int width = 32;
+	int iters = 1;
+	int nt = 0;
+	int rotate = 0;
+	double cold = 0.0, warm = 0.0;
+	size_t bad;
+
+	while ((opt = getopt(argc, argv, "w:i:nrh")) != -1) {
+		switch (opt) {
+		case 'w':
+			width = atoi(optarg);
+			break;
+		case 'i':
+			iters = atoi(optarg);
+			break;
+		case 'n':
+			nt = 1;
+			break;
+		case 'r':
+			rotate = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 0;
+		}
+	}
+	argv += optind - 1;
+	argc -= optind - 1;
 
-	if (argc < 5) {
-		printf("Usage:\n");
-		printf("\t%s fill MemAddr MemSize TestPattern\n", argv[0]);
-		printf("\t%s read MemAddr MemSize TestTotalSize\n", argv[0]);
+	if (argc < 5 || iters < 1) {
+		usage(argv[0]);
 		return 0;
 	}
 
+	if (memaccess_init(&ma, width / 8, 0)) {
+		printf("%d bit access is not supported on this machine\n", width);
+		return -1;
+	}
+	if (nt && memaccess_set_nt(&ma)) {
+		printf("non-temporal %d bit access is not supported\n", width);
+		return -1;
+	}
+
 	sscanf(argv[2], "%x", &mem_addr);
 	sscanf(argv[3], "%x", &mem_size);
 	if (strncmp(argv[1], "fill", 4) == 0) {
@@ -66,41 +187,62 @@ int main(int argc, char **argv)
 		return -1;
 	}
 
-	clock_gettime(CLOCK_REALTIME, &old);
+	memset(&pass, 0, sizeof(pass));
+	pass.ma = &ma;
+	pass.total = test_size;
 	if (write) {
-		int count = mem_size / sizeof(unsigned int);
-		for (i = 0; i < count; i += sizeof(unsigned int)) {
-			unsigned int *p = (unsigned int *)(mem+i);
-			*p = (test_pattern + i);
+		/* build the pattern up front, the timed loop only stores */
+		pattern = aligned_alloc(32, (mem_size + 31) & ~31U);
+		if (!pattern) {
+			perror("malloc");
+			return -1;
 		}
+		for (i = 0; i < mem_size / sizeof(unsigned int); i++)
+			pattern[i] = test_pattern + i * sizeof(unsigned int);
+		pass.src = (char *)pattern;
+		pass.src_size = mem_size;
+		pass.dst = mem;
+		pass.dst_size = mem_size;
 	} else {
-		int count = test_size / BLOCK_SIZE;
-		unsigned int offset = 0;
-		for (i = 0; i < count; i++) {
-			//printf("%4d: read %#x, %#x bytes\n", i, offset, BLOCK_SIZE);
-			memcpy(buf, mem+offset, BLOCK_SIZE);
-			offset += BLOCK_SIZE;
-			if (offset >= mem_size)
-				offset = 0;
-#if 0
-			// dump
-			for(j = 0; j < 128; j+=4) {
-				unsigned int *p = (unsigned int *)&buf[j];
-				if (j % 16 == 0)
-					printf("\n");
-				printf("%08x ", *p);
+		pass.src = mem;
+		pass.src_size = mem_size;
+		pass.dst = buf;
+		pass.dst_size = BLOCK_SIZE;
+		if (rotate) {
+			pass.dst_size = 2 * llc_size();
+			pass.dst = aligned_alloc(32, pass.dst_size);
+			if (!pass.dst) {
+				perror("malloc");
+				return -1;
 			}
-			printf("\n");
-#endif
+			/* fault the buffers in outside of the timed passes */
+			memset(pass.dst, 0, pass.dst_size);
 		}
 	}
-	clock_gettime(CLOCK_REALTIME, &new);
-	speed = (double)test_size * 1000.0 * 1000.0 / time_sub_us(&new, &old);
-	speed = speed / 1024.0 / 1024.0;
-	printf("process %#x bytes, speed %.2fM/s\n", test_size, speed);
 
-	munmap(mem, BLOCK_SIZE);
+	for (i = 0; i < iters; i++) {
+		flush = memaccess_flush(pass.src, pass.src_size);
+		memaccess_flush(pass.dst, pass.dst_size);
+		cold += run_pass(&pass, 1);
+		warm += run_pass(&pass, 0);
+	}
+
+	printf("%d bit %saccess, flush by %s, destination %#zx bytes\n",
+	       width, nt ? "non-temporal " : "", flush ? flush : "none",
+	       pass.dst_size);
+	printf("cold: process %#x bytes, speed %.2fM/s\n", test_size, cold / iters);
+	printf("warm: process %#x bytes, speed %.2fM/s\n", test_size, warm / iters);
+
+	if (write) {
+		bad = ma.cmp(mem, pattern, mem_size);
+		if (bad < (mem_size & ~(ma.width - 1)))
+			printf("verify failed at %#zx\n", mem_addr + bad);
+		free(pattern);
+	}
+	if (pass.dst != buf && pass.dst != mem)
+		free(pass.dst);
+
+	munmap(mem, mem_size);
 	close(fd);
 	return 0;
 }
-
@@ -11,6 +11,7 @@
  * GNU General Public License for more details.
  */
 
+#define _GNU_SOURCE
 #include <libgen.h>
 #include <stdio.h>
 #include <sys/mman.h>
@@ -26,9 +27,21 @@
 #include <string.h>
 #include <inttypes.h>
 #include <time.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#include "memaccess.h"
 
 #define DISP_LINE_LEN	16
 
+#define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
+
 /*
  * Like strtoull() but handles an optional G, M, K or k
  * suffix for Gigabyte, Megabyte or Kilobyte
@@ -108,136 +121,339 @@ static int parse_area_spec(const char *str, off_t *start, size_t *size)
 
 	return -1;
 }
-#define swab64(x) ((uint64_t)(						\
-	(((uint64_t)(x) & (uint64_t)0x00000000000000ffUL) << 56) |	\
-	(((uint64_t)(x) & (uint64_t)0x000000000000ff00UL) << 40) |	\
-	(((uint64_t)(x) & (uint64_t)0x0000000000ff0000UL) << 24) |	\
-	(((uint64_t)(x) & (uint64_t)0x00000000ff000000UL) <<  8) |	\
-	(((uint64_t)(x) & (uint64_t)0x000000ff00000000UL) >>  8) |	\
-	(((uint64_t)(x) & (uint64_t)0x0000ff0000000000UL) >> 24) |	\
-	(((uint64_t)(x) & (uint64_t)0x00ff000000000000UL) >> 40) |	\
-	(((uint64_t)(x) & (uint64_t)0xff00000000000000UL) >> 56)))
-
-#define swab32(x) ((uint32_t)(						\
-	(((uint32_t)(x) & (uint32_t)0x000000ffUL) << 24) |		\
-	(((uint32_t)(x) & (uint32_t)0x0000ff00UL) <<  8) |		\
-	(((uint32_t)(x) & (uint32_t)0x00ff0000UL) >>  8) |		\
-	(((uint32_t)(x) & (uint32_t)0xff000000UL) >> 24)))
-
-#define swab16(x) ((uint16_t)(						\
-	(((uint16_t)(x) & (uint16_t)0x00ffU) << 8) |			\
-	(((uint16_t)(x) & (uint16_t)0xff00U) >> 8)))
-
-static void memory_read_speed_test(const void *addr, size_t nbytes)
-{
-	struct timeval start_time, end_time;
-	int sec,usec,time_us;
-	double speed_MB_s = 0.0;
-	uint8_t width = 1;
-	uint64_t copy_buff_64[nbytes/8];
-	uint32_t copy_buff_32[nbytes/4];
-	uint8_t  copy_buff_8[nbytes];
-
-	gettimeofday(&start_time, NULL);
+
+static void memory_read_speed_test(const struct memaccess *ma,
+				   const void *addr, size_t nbytes, int count)
+{
+	struct timespec start_time, end_time;
+	double time_us, speed_MB_s;
+	void *buf;
+
+	buf = aligned_alloc(32, (nbytes + 31) & ~(size_t)31);
+	if (!buf) {
+		perror("malloc");
+		return;
+	}
+
+	while (count--) {
+		clock_gettime(CLOCK_MONOTONIC, &start_time);
+		ma->copy(buf, addr, nbytes);
+		clock_gettime(CLOCK_MONOTONIC, &end_time);
+
+		time_us = (end_time.tv_sec - start_time.tv_sec) * 1000000.0 +
+			  (end_time.tv_nsec - start_time.tv_nsec) / 1000.0;
+		speed_MB_s = (double)nbytes / time_us * 1000000.0 / 1024.0 / 1024.0;
+		printf("Byte num: %zu Byte, Time %.0f us, Speed : %.02f MB/s\n",
+		       nbytes, time_us, speed_MB_s);
+	}
+
+	free(buf);
+}
+
+static const char hexdigits[] = "0123456789abcdef";
+
+static char *format_hex(char *p, uint64_t val, int digits)
+{
+	int i;
+
+	for (i = digits - 1; i >= 0; i--) {
+		p[i] = hexdigits[val & 0xf];
+		val >>= 4;
+	}
+	return p + digits;
+}
+
 /*
-	for(int i = 0; i< nbytes/width; i++) {
-		memcpy(copy_buff_8, (char *)addr,width);
-		addr += width;
-	}
-*/
-	for(int i = 0; i< nbytes/width; i++) {
-		switch(width) {
-			case 8:
-				copy_buff_64[i] = *(uint64_t *)addr;
+ * Format nbytes of data, read at offset offs, as hexdump lines into out.
+ * raw is the data as read, val the same data swapped for output, ew the
+ * size of a displayed element. Only the first shown bytes appear in the
+ * ASCII column, like md always did for sizes that are not a multiple of
+ * the access width. Returns the number of characters written, at most
+ * DISP_LINE_MAX per started line.
+ */
+#define DISP_LINE_MAX	(17 + 52 + DISP_LINE_LEN + 1)
+
+static size_t format_lines(char *out, const uint8_t *raw, const uint8_t *val,
+			   size_t nbytes, size_t shown, off_t offs,
+			   unsigned int ew)
+{
+	size_t linebytes, i, l;
+	uint64_t res;
+	int digits;
+	char *p = out, *hex;
+
+	for (l = 0; l < nbytes; l += linebytes) {
+		linebytes = (nbytes - l > DISP_LINE_LEN) ?
+			DISP_LINE_LEN : nbytes - l;
+
+		for (digits = 8; digits < 16 &&
+		     (unsigned long long)offs >> (digits * 4); digits++)
+			;
+		p = format_hex(p, offs, digits);
+		*p++ = ':';
+
+		hex = p;
+		for (i = l; i < l + linebytes; i += ew) {
+			switch (ew) {
+			case 8: {
+				uint64_t res64;
+
+				memcpy(&res64, &val[i], 8);
+				res = res64;
 				break;
-			case 4:
-				copy_buff_32[i] = *(uint32_t *)addr;
+			}
+			case 4: {
+				uint32_t res32;
+
+				memcpy(&res32, &val[i], 4);
+				res = res32;
 				break;
-			case 1:
-				copy_buff_8[i] = *(uint8_t *)addr;
+			}
+			case 2: {
+				uint16_t res16;
+
+				memcpy(&res16, &val[i], 2);
+				res = res16;
 				break;
+			}
+			default:
+				res = val[i];
+				break;
+			}
+			*p++ = ' ';
+			p = format_hex(p, res, ew * 2);
 		}
-		addr += width;
+		offs += linebytes;
+
+		while (p < hex + 52)
+			*p++ = ' ';
+
+		for (i = l; i < l + linebytes && i < shown; i++)
+			*p++ = (raw[i] < 0x20 || raw[i] > 0x7e) ? '.' : raw[i];
+
+		*p++ = '\n';
 	}
-	gettimeofday(&end_time, NULL);
 
-	sec = end_time.tv_sec - start_time.tv_sec;
-	usec = end_time.tv_usec - start_time.tv_usec;
-	time_us = sec * 10^6 + usec;
-	speed_MB_s = (double)nbytes/(double)time_us * 1000000.0 / 1024.0 /1024.0;
-	printf("Byte num: %d Byte, Time %d us,Speed : %.02f MB/s\n", nbytes, time_us, speed_MB_s);
+	return p - out;
 }
 
-static int memory_display(const void *addr, off_t offs,
-			  size_t nbytes, int width, int swab)
+/*
+ * Read nbytes at addr with ma and format them into out, which must hold
+ * DISP_LINE_MAX bytes per started line. nbytes is a multiple of the
+ * access width, shown the number of them in the ASCII column.
+ */
+static size_t format_region(const struct memaccess *ma,
+			    const struct memaccess *conv, const void *addr,
+			    off_t offs, size_t nbytes, size_t shown, char *out)
 {
-	size_t linebytes, i;
-	u_char	*cp;
+	unsigned int ew = conv->width;
+	size_t blkbytes, len = 0;
 
-	/* Print the lines.
-	 *
+	/*
 	 * We buffer all read data, so we can make sure data is read only
 	 * once, and all accesses are with the specified bus width.
 	 */
-	do {
-		char linebuf[DISP_LINE_LEN];
-		uint64_t *uqp = (uint64_t *)linebuf;
-		uint32_t *uip = (uint32_t *)linebuf;
-		uint16_t *usp = (uint16_t *)linebuf;
-		uint8_t *ucp = (uint8_t *)linebuf;
-		unsigned count = 52;
-
-		printf("%08llx:", (unsigned long long)offs);
-		linebytes = (nbytes > DISP_LINE_LEN) ? DISP_LINE_LEN : nbytes;
-
-		for (i = 0; i < linebytes; i += width) {
-			if (width == 8) {
-				uint64_t res;
-				res = (*uqp++ = *((uint64_t *)addr));
-				if (swab)
-					res = swab64(res);
-				count -= printf(" %016" PRIx64, res);
-			} else if (width == 4) {
-				uint32_t res;
-				res = (*uip++ = *((uint *)addr));
-				if (swab)
-					res = swab32(res);
-				count -= printf(" %08" PRIx32, res);
-			} else if (width == 2) {
-				uint16_t res;
-				res = (*usp++ = *((ushort *)addr));
-				if (swab)
-					res = swab16(res);
-				count -= printf(" %04" PRIx16, res);
-			} else {
-				count -= printf(" %02x", (*ucp++ = *((u_char *)addr)));
-			}
-			addr += width;
-			offs += width;
-		}
+	while (nbytes > 0) {
+		uint8_t rawbuf[32] __attribute__((aligned(32)));
+		uint8_t valbuf[32] __attribute__((aligned(32)));
+
+		blkbytes = ma->width > DISP_LINE_LEN ? ma->width : DISP_LINE_LEN;
+		if (blkbytes > nbytes)
+			blkbytes = nbytes;
+
+		ma->copy(rawbuf, addr, blkbytes);
+		conv->copy(valbuf, rawbuf, blkbytes);
+
+		len += format_lines(out + len, rawbuf, valbuf, blkbytes,
+				    shown < blkbytes ? shown : blkbytes, offs, ew);
+		addr += blkbytes;
+		offs += blkbytes;
+		nbytes -= blkbytes;
+		shown -= shown < blkbytes ? shown : blkbytes;
+	}
+
+	return len;
+}
+
+#define DISP_STRIPE	(256 * 1024)
 
-		while (count--)
-			putchar(' ');
+static size_t stripe_text_size(size_t nbytes)
+{
+	return (nbytes / DISP_LINE_LEN + 2) * DISP_LINE_MAX;
+}
+
+/*
+ * Parallel export: workers format stripes of DISP_STRIPE bytes into a
+ * ring of 2 * threads buffers, the calling thread writes them out in
+ * address order, so the output is the same as with one thread. Runs with
+ * as many workers as could be started, returns 1 without output if there
+ * are no workers or buffers, so the caller can format sequentially.
+ */
+struct export {
+	const struct memaccess *ma;
+	const struct memaccess *conv;
+	const char *addr;
+	off_t offs;
+	size_t nbytes;
+	size_t shown;		/* bytes shown in the ASCII column */
+	size_t nr_stripes;
+	size_t nr_slots;
+	size_t next;		/* next stripe to format */
+	size_t written;		/* next stripe to write */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct export_slot {
+		char *buf;
+		size_t len;
+		int done;
+	} *slots;
+};
+
+static void *export_thread(void *arg)
+{
+	struct export *e = arg;
+	struct export_slot *slot;
+	size_t k, pos, n;
+
+	pthread_mutex_lock(&e->lock);
+	for (;;) {
+		while (e->next < e->nr_stripes &&
+		       e->next >= e->written + e->nr_slots)
+			pthread_cond_wait(&e->cond, &e->lock);
+		if (e->next >= e->nr_stripes)
+			break;
+		k = e->next++;
+		pthread_mutex_unlock(&e->lock);
+
+		slot = &e->slots[k % e->nr_slots];
+		pos = k * DISP_STRIPE;
+		n = e->nbytes - pos > DISP_STRIPE ? DISP_STRIPE : e->nbytes - pos;
+		slot->len = format_region(e->ma, e->conv, e->addr + pos,
+					  e->offs + pos, n, e->shown - pos,
+					  slot->buf);
+
+		pthread_mutex_lock(&e->lock);
+		slot->done = 1;
+		pthread_cond_broadcast(&e->cond);
+	}
+	pthread_mutex_unlock(&e->lock);
+
+	return NULL;
+}
 
-		cp = (uint8_t *)linebuf;
-		for (i = 0; i < linebytes; i++) {
-			if ((*cp < 0x20) || (*cp > 0x7e))
-				putchar('.');
-			else
-				printf("%c", *cp);
-			cp++;
+static int memory_export(const struct memaccess *ma,
+			 const struct memaccess *conv, const void *addr,
+			 off_t offs, size_t nbytes, size_t shown, int threads)
+{
+	struct export e = {
+		.ma = ma,
+		.conv = conv,
+		.addr = addr,
+		.offs = offs,
+		.nbytes = nbytes,
+		.shown = shown,
+		.nr_stripes = (nbytes + DISP_STRIPE - 1) / DISP_STRIPE,
+		.nr_slots = 2 * threads,
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
+	struct export_slot *slot;
+	pthread_t tid[threads];
+	size_t k;
+	int i, ret = 0;
+
+	e.slots = calloc(e.nr_slots, sizeof(*e.slots));
+	if (!e.slots)
+		return 1;
+	for (k = 0; k < e.nr_slots; k++) {
+		e.slots[k].buf = malloc(stripe_text_size(DISP_STRIPE));
+		if (!e.slots[k].buf) {
+			ret = 1;
+			goto out;
 		}
+	}
+
+	for (i = 0; i < threads; i++)
+		if (pthread_create(&tid[i], NULL, export_thread, &e))
+			break;
+	threads = i;
+	if (!threads) {
+		ret = 1;
+		goto out;
+	}
+
+	for (k = 0; k < e.nr_stripes; k++) {
+		slot = &e.slots[k % e.nr_slots];
+
+		pthread_mutex_lock(&e.lock);
+		while (!slot->done)
+			pthread_cond_wait(&e.cond, &e.lock);
+		pthread_mutex_unlock(&e.lock);
+
+		fwrite(slot->buf, 1, slot->len, stdout);
+
+		pthread_mutex_lock(&e.lock);
+		slot->done = 0;
+		e.written++;
+		pthread_cond_broadcast(&e.cond);
+		pthread_mutex_unlock(&e.lock);
+	}
+
+	for (i = 0; i < threads; i++)
+		pthread_join(tid[i], NULL);
+out:
+	for (k = 0; k < e.nr_slots; k++)
+		free(e.slots[k].buf);
+	free(e.slots);
+
+	return ret;
+}
+
+static int memory_display(const struct memaccess *ma, const void *addr,
+			  off_t offs, size_t nbytes, int swab, int threads)
+{
+	unsigned int ew = ma->width > 8 ? 8 : ma->width;
+	struct memaccess conv;
+	size_t n, shown = nbytes;
+	char *buf;
+	int ret;
+
+	/* wide accesses are shown as quads */
+	if (memaccess_init(&conv, ew, swab ? ew : 0))
+		return -1;
+
+	/* the last access is always complete, its tail stays out of ASCII */
+	nbytes = (nbytes + ma->width - 1) & ~(size_t)(ma->width - 1);
+
+	if (threads > 1 && nbytes > DISP_STRIPE) {
+		ret = memory_export(ma, &conv, addr, offs, nbytes, shown,
+				    threads);
+		if (ret <= 0)
+			return ret;
+	}
+
+	buf = malloc(stripe_text_size(DISP_STRIPE));
+	if (!buf)
+		return -1;
+
+	while (nbytes > 0) {
+		n = nbytes > DISP_STRIPE ? DISP_STRIPE : nbytes;
+		fwrite(buf, 1, format_region(ma, &conv, addr, offs, n, shown,
+					     buf), stdout);
+		addr += n;
+		offs += n;
+		nbytes -= n;
+		shown -= shown < n ? shown : n;
+	}
 
-		putchar('\n');
-		nbytes -= linebytes;
-	} while (nbytes > 0);
+	free(buf);
 
 	return 0;
 }
 
 static int memfd;
 
-static void *memmap(const char *file, off_t addr, size_t size)
+static void *memmap_fd(int fd, off_t addr, size_t size)
 {
 	off_t mmap_start;
 	size_t ofs;
@@ -247,27 +463,34 @@ static void *memmap(const char *file, off_t addr, size_t size)
 	if (pagesize < 0)
 		pagesize = 4096;
 
+	mmap_start = addr & ~((off_t)pagesize - 1);
+	ofs = addr - mmap_start;
+
+	mem = mmap(0, size + ofs, PROT_READ | PROT_WRITE, MAP_SHARED,
+		   fd, mmap_start);
+	if (mem == MAP_FAILED)
+		return NULL;
+
+	return mem + ofs;
+}
+
+static void *memmap(const char *file, off_t addr, size_t size)
+{
+	void *mem;
+
 	memfd = open(file, O_RDWR);
 	if (memfd < 0) {
 		perror("open");
 		exit(1);
 	}
 
-	mmap_start = addr & ~((off_t)pagesize - 1);
-	ofs = addr - mmap_start;
-
-	mem = mmap(0, size + ofs, PROT_READ | PROT_WRITE, MAP_SHARED,
-		   memfd, mmap_start);
-	if (mem == MAP_FAILED) {
+	mem = memmap_fd(memfd, addr, size);
+	if (!mem) {
 		perror("mmap");
-		goto out;
+		close(memfd);
 	}
 
-	return mem + ofs;
-out:
-	close(memfd);
-
-	return NULL;
+	return mem;
 }
 
 static void usage_md(void)
@@ -275,7 +498,7 @@ static void usage_md(void)
 	printf(
 "md - memory display\n"
 "\n"
-"Usage: md [-bwlqsx] REGION\n"
+"Usage: md [-bwlqoysxt] [-c COUNT] [-j N] REGION\n"
 "\n"
 "Display (hex dump) a memory region.\n"
 "\n"
@@ -284,8 +507,13 @@ static void usage_md(void)
 "  -w        word access (16 bit)\n"
 "  -l        long access (32 bit)\n"
 "  -q        quad access (64 bit)\n"
+"  -o        octa access (128 bit, shown as quads)\n"
+"  -y        256 bit access (shown as quads)\n"
 "  -s <FILE> display file (default /dev/mem)\n"
 "  -x        swap bytes at output\n"
+"  -t        measure the read speed instead of displaying\n"
+"  -c <N>    number of speed test passes (default 50)\n"
+"  -j <N>    format with N threads, the output is the same\n"
 "\n"
 "Memory regions can be specified in two different forms: START+SIZE\n"
 "or START-END, If START is omitted it defaults to 0x100\n"
@@ -304,8 +532,13 @@ static int cmd_memory_display(int argc, char **argv)
 	void *mem;
 	char *file = "/dev/mem";
 	int swap = 0;
+	int speed = 0;
+	int count = 50;
+	int threads = 1;
+	struct memaccess ma;
+	int ret;
 
-	while ((opt = getopt(argc, argv, "bwlqs:xh")) != -1) {
+	while ((opt = getopt(argc, argv, "bwlqoys:xtc:j:h")) != -1) {
 		switch (opt) {
 		case 'b':
 			width = 1;
@@ -319,12 +552,27 @@ static int cmd_memory_display(int argc, char **argv)
 		case 'q':
 			width = 8;
 			break;
+		case 'o':
+			width = 16;
+			break;
+		case 'y':
+			width = 32;
+			break;
 		case 's':
 			file = optarg;
 			break;
 		case 'x':
 			swap = 1;
 			break;
+		case 't':
+			speed = 1;
+			break;
+		case 'c':
+			count = strtoul(optarg, NULL, 0);
+			break;
+		case 'j':
+			threads = atoi(optarg);
+			break;
 		case 'h':
 			usage_md();
 			return 0;
@@ -340,16 +588,32 @@ static int cmd_memory_display(int argc, char **argv)
 			size = 0x100;
 	}
 
+	/* byte swapping happens at output, the reads are never swapped */
+	if (memaccess_init(&ma, width, 0)) {
+		printf("%d bit access is not supported on this machine\n",
+		       width * 8);
+		return 1;
+	}
+
+	if (width > 8 && start % width) {
+		printf("start must be aligned to %d bytes\n", width);
+		return 1;
+	}
+
 	mem = memmap(file, start, size);
+	if (!mem)
+		return 1;
 
-	//memory_display(mem, start, size, width, swap);
-	char num = 50;
-	while(num--)
-	memory_read_speed_test(mem, size);
+	if (speed) {
+		memory_read_speed_test(&ma, mem, size, count);
+		ret = 0;
+	} else {
+		ret = memory_display(&ma, mem, start, size, swap, threads);
+	}
 
 	close(memfd);
 
-	exit(1);
+	return ret ? 1 : 0;
 }
 
 static void usage_mw(void)
@@ -443,12 +707,1010 @@ static int cmd_memory_write(int argc, char *argv[])
 	return 0;
 }
 
+/*
+ * Memory access daemon
+ *
+ * The daemon keeps FILE open and its pages mapped, and serves register
+ * reads and writes to local clients, so polling a register does not cost
+ * an exec, an open and an mmap each time.
+ *
+ * Clients connect to a SOCK_SEQPACKET unix socket and send a struct
+ * md_hello. If the client asks for it, the daemon answers with a memfd
+ * holding a struct md_ring and two eventfds: the client queues requests
+ * in the ring and kicks the first eventfd, the daemon completes them in
+ * place, advances sq_head and signals the second one. Without a ring each
+ * message on the socket is an array of struct md_req that is sent back
+ * completed.
+ *
+ * All requests that arrive in one epoll round form a batch. Reads between
+ * two writes are grouped by page across clients, so each mapping is looked
+ * up once, but every client's own reads keep their order since device
+ * reads can have side effects. Writes are never reordered and every
+ * client's read after its write sees it.
+ * Writes and refused requests are audited with the peer's pid and uid.
+ */
+#define MD_SOCKET	"/run/memtool.sock"
+#define MD_MAGIC	0x4d454d44	/* "MEMD" */
+#define MD_RING_SLOTS	256
+#define MD_MAP_CACHE	64
+#define MD_SPIN		2000
+
+#define MD_OP_READ	0
+#define MD_OP_WRITE	1
+
+#define MD_HELLO_RING	(1 << 0)
+
+struct md_hello {
+	uint32_t magic;
+	uint32_t flags;
+};
+
+struct md_req {
+	uint32_t op;
+	uint32_t width;
+	uint64_t addr;
+	uint64_t val;
+	int32_t status;		/* 0 or a negative errno */
+	uint32_t pad;
+};
+
+struct md_ring {
+	uint32_t magic;
+	uint32_t nr_slots;
+	uint32_t sq_head;	/* written by the daemon only */
+	uint8_t pad0[52];
+	uint32_t sq_tail;	/* written by the client only */
+	uint8_t pad1[60];
+	struct md_req slots[];
+};
+
+struct md_client;
+
+/* epoll tag, one for the socket and one for the ring doorbell */
+struct md_source {
+	struct md_client *client;
+	int kick;
+};
+
+struct md_client {
+	int sock;
+	struct md_ring *ring;
+	size_t ring_len;
+	int kick_fd;
+	int done_fd;
+	uint32_t head;
+	pid_t pid;
+	uid_t uid;
+	double tokens;
+	struct timespec refill;
+	struct md_source src_sock;
+	struct md_source src_kick;
+	int reply;		/* socket mode: requests to send back */
+	struct md_req *msg;
+	int hello;		/* waiting for struct md_hello */
+	size_t run_head;	/* first read not yet run, or SIZE_MAX */
+	size_t run_tail;
+	int dead;
+	struct md_client *next_dead;
+};
+
+struct md_work {
+	struct md_req req;
+	struct md_client *client;
+	uint32_t slot;		/* ring slot, or index into client->msg */
+	size_t next;		/* the client's next read in this run */
+};
+
+struct md_map {
+	off_t page;
+	void *mem;
+};
+
+struct md_daemon {
+	int fd;
+	int epfd;
+	int listen_fd;
+	long pagesize;
+	off_t start;
+	size_t size;
+	double rate;
+	int verbose;
+	FILE *audit;
+	struct memaccess acc[4];	/* 1, 2, 4 and 8 byte accesses */
+	struct md_map map[MD_MAP_CACHE];
+	struct md_work *work;
+	struct md_client **run;		/* clients with reads in this run */
+	size_t nr_work;
+	size_t max_work;
+	struct md_client *dead;		/* freed at the end of the round */
+};
+
+static volatile sig_atomic_t md_stop;
+
+static void md_signal(int sig)
+{
+	md_stop = 1;
+}
+
+/*
+ * An access past the end of a file or to an unbacked page raises SIGBUS.
+ * md_exec arms md_fault around each access so it fails that request only.
+ */
+static sigjmp_buf md_fault;
+static volatile sig_atomic_t md_fault_armed;
+
+static void md_sigbus(int sig)
+{
+	if (md_fault_armed) {
+		md_fault_armed = 0;
+		siglongjmp(md_fault, 1);
+	}
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+static int md_acc_idx(uint32_t width)
+{
+	switch (width) {
+	case 1: return 0;
+	case 2: return 1;
+	case 4: return 2;
+	case 8: return 3;
+	}
+	return -1;
+}
+
+static void md_audit(struct md_daemon *d, struct md_client *c,
+		     const struct md_req *req, const char *what)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	fprintf(d->audit, "%lld.%06ld pid=%d uid=%u %s %s 0x%llx/%u",
+		(long long)ts.tv_sec, ts.tv_nsec / 1000, (int)c->pid,
+		(unsigned)c->uid, req->op == MD_OP_WRITE ? "write" : "read",
+		what, (unsigned long long)req->addr, req->width);
+	if (req->op == MD_OP_WRITE || !req->status)
+		fprintf(d->audit, " = 0x%llx", (unsigned long long)req->val);
+	if (req->status)
+		fprintf(d->audit, " (%s)", strerror(-req->status));
+	fputc('\n', d->audit);
+	fflush(d->audit);
+}
+
+/* token bucket, rate requests per second with a burst of one second */
+static int md_admit(struct md_daemon *d, struct md_client *c)
+{
+	struct timespec now;
+
+	if (d->rate <= 0)
+		return 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	c->tokens += ((now.tv_sec - c->refill.tv_sec) +
+		      (now.tv_nsec - c->refill.tv_nsec) / 1e9) * d->rate;
+	if (c->tokens > d->rate)
+		c->tokens = d->rate;
+	c->refill = now;
+
+	if (c->tokens < 1.0)
+		return 0;
+	c->tokens -= 1.0;
+	return 1;
+}
+
+/* cached one page mappings, direct mapped by page number */
+static void *md_map_page(struct md_daemon *d, off_t page)
+{
+	struct md_map *m = &d->map[(page / d->pagesize) % MD_MAP_CACHE];
+
+	if (m->mem && m->page == page)
+		return m->mem;
+
+	if (m->mem)
+		munmap(m->mem, d->pagesize);
+	m->mem = memmap_fd(d->fd, page, d->pagesize);
+	m->page = page;
+	return m->mem;
+}
+
+/* queue a request, requests that are refused up front complete at once */
+static void md_queue(struct md_daemon *d, struct md_client *c,
+		     const struct md_req *req, uint32_t slot)
+{
+	struct md_work *w;
+
+	if (d->nr_work == d->max_work) {
+		d->max_work = d->max_work ? d->max_work * 2 : MD_RING_SLOTS;
+		d->work = realloc(d->work, d->max_work * sizeof(*d->work));
+		d->run = realloc(d->run, d->max_work * sizeof(*d->run));
+		if (!d->work || !d->run) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+
+	w = &d->work[d->nr_work];
+	w->req = *req;
+	w->client = c;
+	w->slot = slot;
+	d->nr_work++;
+
+	if (md_acc_idx(req->width) < 0 || req->addr & (req->width - 1) ||
+	    (req->op != MD_OP_READ && req->op != MD_OP_WRITE))
+		w->req.status = -EINVAL;
+	else if (req->width > d->size || req->addr < d->start ||
+		 req->addr - d->start > d->size - req->width)
+		w->req.status = -EPERM;
+	else if (!md_admit(d, c))
+		w->req.status = -EAGAIN;
+	else
+		w->req.status = 1;	/* pending */
+
+	if (w->req.status < 0)
+		md_audit(d, c, &w->req, "refused");
+}
+
+static off_t md_work_page(struct md_daemon *d, const struct md_work *w)
+{
+	return w->req.addr & ~((off_t)d->pagesize - 1);
+}
+
+static void md_exec(struct md_daemon *d, struct md_work *w, off_t *page,
+		    void **mem)
+{
+	struct md_req *req = &w->req;
+	off_t p = md_work_page(d, w);
+	const struct memaccess *ma = &d->acc[md_acc_idx(req->width)];
+	union {
+		uint8_t b;
+		uint16_t w;
+		uint32_t l;
+		uint64_t q;
+	} v;
+	void *addr;
+
+	if (req->status != 1)
+		return;
+
+	if (!*mem || *page != p) {
+		*page = p;
+		*mem = md_map_page(d, p);
+	}
+	if (!*mem) {
+		req->status = -errno;
+		return;
+	}
+	addr = *mem + (req->addr - p);
+
+	if (sigsetjmp(md_fault, 0)) {
+		req->status = -EFAULT;
+		md_audit(d, w->client, req, "faulted");
+		return;
+	}
+
+	if (req->op == MD_OP_WRITE) {
+		switch (req->width) {
+		case 1: v.b = req->val; break;
+		case 2: v.w = req->val; break;
+		case 4: v.l = req->val; break;
+		default: v.q = req->val; break;
+		}
+		md_fault_armed = 1;
+		ma->copy(addr, &v, req->width);
+		md_fault_armed = 0;
+		req->status = 0;
+		md_audit(d, w->client, req, "ok");
+		return;
+	}
+
+	md_fault_armed = 1;
+	ma->copy(&v, addr, req->width);
+	md_fault_armed = 0;
+	switch (req->width) {
+	case 1: req->val = v.b; break;
+	case 2: req->val = v.w; break;
+	case 4: req->val = v.l; break;
+	default: req->val = v.q; break;
+	}
+	req->status = 0;
+	if (d->verbose)
+		md_audit(d, w->client, req, "ok");
+}
+
+/*
+ * Run the reads work[i, j). The oldest read left picks a page, then each
+ * client runs its next reads for as long as they are on that page.
+ */
+static void md_run_reads(struct md_daemon *d, size_t i, size_t j,
+			 off_t *page, void **mem)
+{
+	struct md_client *c;
+	size_t k, n, nr = 0, left = j - i;
+	off_t p;
+
+	for (k = i; k < j; k++) {
+		c = d->work[k].client;
+		d->work[k].next = SIZE_MAX;
+		if (c->run_head == SIZE_MAX) {
+			c->run_head = k;
+			d->run[nr++] = c;
+		} else {
+			d->work[c->run_tail].next = k;
+		}
+		c->run_tail = k;
+	}
+
+	while (left) {
+		for (n = 0, k = SIZE_MAX; n < nr; n++)
+			if (d->run[n]->run_head < k)
+				k = d->run[n]->run_head;
+		p = md_work_page(d, &d->work[k]);
+
+		for (n = 0; n < nr; n++) {
+			c = d->run[n];
+			while ((k = c->run_head) != SIZE_MAX &&
+			       md_work_page(d, &d->work[k]) == p) {
+				c->run_head = d->work[k].next;
+				md_exec(d, &d->work[k], page, mem);
+				left--;
+			}
+		}
+	}
+}
+
+static void md_run_batch(struct md_daemon *d)
+{
+	void *mem = NULL;
+	off_t page = 0;
+	size_t i, j;
+
+	for (i = 0; i < d->nr_work; i = j) {
+		if (d->work[i].req.op == MD_OP_WRITE) {
+			md_exec(d, &d->work[i], &page, &mem);
+			j = i + 1;
+			continue;
+		}
+		for (j = i; j < d->nr_work; j++)
+			if (d->work[j].req.op == MD_OP_WRITE)
+				break;
+		md_run_reads(d, i, j, &page, &mem);
+	}
+}
+
+static void md_client_free(struct md_daemon *d, struct md_client *c)
+{
+	epoll_ctl(d->epfd, EPOLL_CTL_DEL, c->sock, NULL);
+	close(c->sock);
+	if (c->ring) {
+		epoll_ctl(d->epfd, EPOLL_CTL_DEL, c->kick_fd, NULL);
+		munmap(c->ring, c->ring_len);
+		close(c->kick_fd);
+		close(c->done_fd);
+	}
+	free(c->msg);
+	free(c);
+}
+
+static int md_ring_setup(struct md_client *c)
+{
+	int memfd;
+
+	c->ring_len = sizeof(*c->ring) + MD_RING_SLOTS * sizeof(struct md_req);
+	memfd = memfd_create("memtool-ring", MFD_CLOEXEC);
+	if (memfd < 0)
+		return -1;
+	if (ftruncate(memfd, c->ring_len))
+		goto err;
+	c->ring = mmap(NULL, c->ring_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+		       memfd, 0);
+	if (c->ring == MAP_FAILED) {
+		c->ring = NULL;
+		goto err;
+	}
+	c->ring->magic = MD_MAGIC;
+	c->ring->nr_slots = MD_RING_SLOTS;
+
+	c->kick_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	c->done_fd = eventfd(0, EFD_CLOEXEC);
+	if (c->kick_fd < 0 || c->done_fd < 0)
+		goto err;
+
+	return memfd;
+err:
+	if (c->ring)
+		munmap(c->ring, c->ring_len);
+	c->ring = NULL;
+	if (c->kick_fd >= 0)
+		close(c->kick_fd);
+	if (c->done_fd >= 0)
+		close(c->done_fd);
+	close(memfd);
+	return -1;
+}
+
+/*
+ * The socket is non blocking and the hello is read from the epoll loop, so
+ * a client that connects and stays silent cannot stall the others.
+ */
+static void md_accept(struct md_daemon *d)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	struct md_client *c;
+	struct epoll_event ev;
+	int sock;
+
+	sock = accept4(d->listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if (sock < 0)
+		return;
+
+	c = calloc(1, sizeof(*c));
+	if (!c) {
+		close(sock);
+		return;
+	}
+	c->sock = sock;
+	c->kick_fd = c->done_fd = -1;
+	c->hello = 1;
+	c->run_head = SIZE_MAX;
+	c->tokens = d->rate;
+	clock_gettime(CLOCK_MONOTONIC, &c->refill);
+	if (!getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len)) {
+		c->pid = cred.pid;
+		c->uid = cred.uid;
+	}
+
+	c->src_sock.client = c;
+	ev.events = EPOLLIN;
+	ev.data.ptr = &c->src_sock;
+	if (epoll_ctl(d->epfd, EPOLL_CTL_ADD, sock, &ev))
+		md_client_free(d, c);
+}
+
+/* answer the hello, with the ring fds if the client wants them */
+static int md_hello(struct md_daemon *d, struct md_client *c)
+{
+	struct md_hello hello;
+	struct epoll_event ev;
+	union {
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+		struct cmsghdr align;
+	} u;
+	struct iovec iov = { .iov_base = &hello, .iov_len = sizeof(hello) };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+	struct cmsghdr *cmsg;
+	int memfd = -1, ret = -1;
+	ssize_t n;
+
+	n = recv(c->sock, &hello, sizeof(hello), 0);
+	if (n < 0 && errno == EAGAIN)
+		return 0;
+	if (n != sizeof(hello) || hello.magic != MD_MAGIC)
+		return -1;
+	c->hello = 0;
+
+	/* fall back to the socket if there is no memfd or eventfd */
+	if (hello.flags & MD_HELLO_RING)
+		memfd = md_ring_setup(c);
+	hello.flags = memfd >= 0 ? MD_HELLO_RING : 0;
+
+	if (memfd >= 0) {
+		msg.msg_control = u.buf;
+		msg.msg_controllen = sizeof(u.buf);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(3 * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), (int []){ memfd, c->kick_fd, c->done_fd },
+		       3 * sizeof(int));
+	} else {
+		c->msg = malloc(MD_RING_SLOTS * sizeof(*c->msg));
+		if (!c->msg)
+			goto out;
+	}
+	if (sendmsg(c->sock, &msg, MSG_NOSIGNAL) != sizeof(hello))
+		goto out;
+
+	if (c->ring) {
+		c->src_kick.client = c;
+		c->src_kick.kick = 1;
+		ev.events = EPOLLIN;
+		ev.data.ptr = &c->src_kick;
+		if (epoll_ctl(d->epfd, EPOLL_CTL_ADD, c->kick_fd, &ev))
+			goto out;
+	}
+	if (d->verbose)
+		fprintf(d->audit, "pid=%d uid=%u connected, %s\n", (int)c->pid,
+			(unsigned)c->uid, c->ring ? "ring" : "socket");
+	ret = 0;
+out:
+	if (memfd >= 0)
+		close(memfd);
+	return ret;
+}
+
+/* returns -1 if the client is gone or misbehaves */
+static int md_client_read(struct md_daemon *d, struct md_source *src)
+{
+	struct md_client *c = src->client;
+	struct md_ring *r = c->ring;
+	uint64_t cnt;
+	uint32_t tail;
+	ssize_t n;
+	int i;
+
+	if (c->hello)
+		return md_hello(d, c);
+
+	if (src->kick) {
+		if (read(c->kick_fd, &cnt, sizeof(cnt)) != sizeof(cnt))
+			return 0;
+		tail = __atomic_load_n(&r->sq_tail, __ATOMIC_ACQUIRE);
+		/* nr_slots in the ring is client writable */
+		if (tail - c->head > MD_RING_SLOTS)
+			return -1;
+		for (; c->head != tail; c->head++)
+			md_queue(d, c, &r->slots[c->head % MD_RING_SLOTS],
+				 c->head % MD_RING_SLOTS);
+		return 0;
+	}
+
+	/* with a ring the socket only reports the hangup */
+	if (r)
+		return -1;
+
+	n = recv(c->sock, c->msg, MD_RING_SLOTS * sizeof(*c->msg), 0);
+	if (n < 0 && errno == EAGAIN)
+		return 0;
+	if (n <= 0 || n % sizeof(*c->msg))
+		return -1;
+	c->reply = n / sizeof(*c->msg);
+	for (i = 0; i < c->reply; i++)
+		md_queue(d, c, &c->msg[i], i);
+	return 0;
+}
+
+static void md_complete(struct md_daemon *d)
+{
+	struct md_work *w;
+	struct md_client *c;
+	uint64_t one = 1;
+	size_t i;
+
+	for (i = 0; i < d->nr_work; i++) {
+		w = &d->work[i];
+		c = w->client;
+		if (c->dead)
+			continue;
+		if (c->ring)
+			c->ring->slots[w->slot] = w->req;
+		else
+			c->msg[w->slot] = w->req;
+	}
+
+	/* every client is signalled once per batch */
+	for (i = 0; i < d->nr_work; i++) {
+		c = d->work[i].client;
+		if (c->dead)
+			continue;
+		if (c->ring && c->ring->sq_head != c->head) {
+			__atomic_store_n(&c->ring->sq_head, c->head,
+					 __ATOMIC_RELEASE);
+			if (write(c->done_fd, &one, sizeof(one)) < 0)
+				perror("write");
+		} else if (!c->ring && c->reply) {
+			/* a client that does not read its replies is dropped */
+			if (send(c->sock, c->msg, c->reply * sizeof(*c->msg),
+				 MSG_NOSIGNAL) != c->reply * sizeof(*c->msg)) {
+				c->dead = 1;
+				c->next_dead = d->dead;
+				d->dead = c;
+			}
+			c->reply = 0;
+		}
+	}
+	d->nr_work = 0;
+}
+
+static void usage_daemon(void)
+{
+	printf(
+"daemon - serve memory accesses to local clients\n"
+"\n"
+"Usage: daemon [-s SOCKET] [-d FILE] [-R REGION] [-r RATE] [-a FILE] [-v]\n"
+"\n"
+"Keep FILE mapped and serve reads and writes from 'memtool client'.\n"
+"\n"
+"Options:\n"
+"  -s <SOCKET> unix socket to listen on (default " MD_SOCKET ")\n"
+"  -d <FILE>   file to access (default /dev/mem)\n"
+"  -R <REGION> only allow accesses to REGION (START+SIZE or START-END)\n"
+"  -r <RATE>   limit every client to RATE requests per second\n"
+"  -a <FILE>   append the audit log to FILE (default stderr)\n"
+"  -v          audit reads and connections too\n"
+"\n"
+"Writes and refused requests are always audited.\n"
+	);
+}
+
+static int cmd_daemon(int argc, char **argv)
+{
+	struct md_daemon d = {
+		.start = 0,
+		.size = ~(size_t)0,
+		.audit = stderr,
+	};
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct sigaction sa = { .sa_handler = md_sigbus, .sa_flags = SA_NODEFER };
+	struct stat st;
+	const char *sock_path = MD_SOCKET;
+	const char *file = "/dev/mem";
+	struct epoll_event ev[64];
+	struct md_source *src;
+	int opt, i, n;
+
+	while ((opt = getopt(argc, argv, "s:d:R:r:a:vh")) != -1) {
+		switch (opt) {
+		case 's':
+			sock_path = optarg;
+			break;
+		case 'd':
+			file = optarg;
+			break;
+		case 'R':
+			if (parse_area_spec(optarg, &d.start, &d.size)) {
+				printf("could not parse: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'r':
+			d.rate = strtod(optarg, NULL);
+			break;
+		case 'a':
+			d.audit = fopen(optarg, "a");
+			if (!d.audit) {
+				perror("fopen");
+				return 1;
+			}
+			break;
+		case 'v':
+			d.verbose = 1;
+			break;
+		case 'h':
+			usage_daemon();
+			return 0;
+		}
+	}
+
+	d.pagesize = sysconf(_SC_PAGE_SIZE);
+	if (d.pagesize < 0)
+		d.pagesize = 4096;
+	for (i = 0; i < 4; i++)
+		memaccess_init(&d.acc[i], 1 << i, 0);
+
+	d.fd = open(file, O_RDWR | O_CLOEXEC);
+	if (d.fd < 0) {
+		perror("open");
+		return 1;
+	}
+
+	/* a regular file only backs its current size */
+	if (fstat(d.fd, &st)) {
+		perror("fstat");
+		return 1;
+	}
+	if (S_ISREG(st.st_mode)) {
+		if (d.start > st.st_size) {
+			fprintf(stderr, "region starts past the end of %s\n", file);
+			return 1;
+		}
+		if (d.size > (uint64_t)(st.st_size - d.start))
+			d.size = st.st_size - d.start;
+	}
+
+	if (strlen(sock_path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "socket path too long\n");
+		return 1;
+	}
+	strcpy(addr.sun_path, sock_path);
+	unlink(sock_path);
+	d.listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (d.listen_fd < 0 ||
+	    bind(d.listen_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(d.listen_fd, 16)) {
+		perror("socket");
+		return 1;
+	}
+
+	d.epfd = epoll_create1(EPOLL_CLOEXEC);
+	ev[0].events = EPOLLIN;
+	ev[0].data.ptr = NULL;
+	epoll_ctl(d.epfd, EPOLL_CTL_ADD, d.listen_fd, &ev[0]);
+
+	signal(SIGINT, md_signal);
+	signal(SIGTERM, md_signal);
+	signal(SIGPIPE, SIG_IGN);
+	/* SA_NODEFER: md_sigbus leaves with siglongjmp, no mask to restore */
+	sigaction(SIGBUS, &sa, NULL);
+
+	while (!md_stop) {
+		n = epoll_wait(d.epfd, ev, ARRAY_SIZE(ev), -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			src = ev[i].data.ptr;
+			if (!src) {
+				md_accept(&d);
+				continue;
+			}
+			if (src->client->dead)
+				continue;
+			if (md_client_read(&d, src) < 0) {
+				src->client->dead = 1;
+				src->client->next_dead = d.dead;
+				d.dead = src->client;
+			}
+		}
+
+		md_run_batch(&d);
+		md_complete(&d);
+
+		while (d.dead) {
+			src = &d.dead->src_sock;
+			d.dead = d.dead->next_dead;
+			md_client_free(&d, src->client);
+		}
+	}
+
+	unlink(sock_path);
+	close(d.listen_fd);
+	close(d.epfd);
+	close(d.fd);
+
+	return 0;
+}
+
+struct mc_conn {
+	int sock;
+	struct md_ring *ring;
+	size_t ring_len;
+	int kick_fd;
+	int done_fd;
+};
+
+static int mc_connect(struct mc_conn *mc, const char *path, int ring)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct md_hello hello = { .magic = MD_MAGIC };
+	union {
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+		struct cmsghdr align;
+	} u;
+	struct iovec iov = { .iov_base = &hello, .iov_len = sizeof(hello) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = u.buf,
+		.msg_controllen = sizeof(u.buf),
+	};
+	struct cmsghdr *cmsg;
+	struct stat st;
+	int fds[3];
+
+	memset(mc, 0, sizeof(*mc));
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	mc->sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (mc->sock < 0 ||
+	    connect(mc->sock, (struct sockaddr *)&addr, sizeof(addr)))
+		return -1;
+
+	hello.flags = ring ? MD_HELLO_RING : 0;
+	if (send(mc->sock, &hello, sizeof(hello), 0) != sizeof(hello) ||
+	    recvmsg(mc->sock, &msg, MSG_CMSG_CLOEXEC) != sizeof(hello) ||
+	    hello.magic != MD_MAGIC)
+		return -1;
+
+	if (!(hello.flags & MD_HELLO_RING))
+		return 0;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+	    cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))
+		return -1;
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+	mc->kick_fd = fds[1];
+	mc->done_fd = fds[2];
+
+	if (fstat(fds[0], &st))
+		return -1;
+	mc->ring_len = st.st_size;
+	mc->ring = mmap(NULL, mc->ring_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+			fds[0], 0);
+	close(fds[0]);
+	if (mc->ring == MAP_FAILED || mc->ring->magic != MD_MAGIC) {
+		mc->ring = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/* run nr requests, at most MD_RING_SLOTS */
+static int mc_batch(struct mc_conn *mc, struct md_req *req, int nr)
+{
+	struct md_ring *r = mc->ring;
+	struct pollfd pfd[2] = {
+		{ .fd = mc->done_fd, .events = POLLIN },
+		{ .fd = mc->sock, .events = POLLIN },
+	};
+	uint32_t tail, i;
+	uint64_t cnt = 1;
+	int spin;
+
+	if (!r) {
+		if (send(mc->sock, req, nr * sizeof(*req), 0) < 0 ||
+		    recv(mc->sock, req, nr * sizeof(*req), 0) !=
+		    nr * sizeof(*req))
+			return -1;
+		return 0;
+	}
+
+	tail = r->sq_tail;
+	for (i = 0; i < nr; i++)
+		r->slots[(tail + i) % r->nr_slots] = req[i];
+	tail += nr;
+	__atomic_store_n(&r->sq_tail, tail, __ATOMIC_RELEASE);
+	if (write(mc->kick_fd, &cnt, sizeof(cnt)) != sizeof(cnt))
+		return -1;
+
+	/*
+	 * Registers answer quickly, spin a little before sleeping. The daemon
+	 * never writes to the socket in ring mode, so any event on it means
+	 * the daemon is gone.
+	 */
+	for (spin = 0; __atomic_load_n(&r->sq_head, __ATOMIC_ACQUIRE) != tail;
+	     spin++) {
+		if (spin < MD_SPIN)
+			continue;
+		if (pfd[1].revents) {
+			errno = EPIPE;
+			return -1;
+		}
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if ((pfd[0].revents & POLLIN) &&
+		    read(mc->done_fd, &cnt, sizeof(cnt)) != sizeof(cnt))
+			return -1;
+	}
+
+	for (i = 0; i < nr; i++)
+		req[i] = r->slots[(tail - nr + i) % r->nr_slots];
+	return 0;
+}
+
+static void usage_client(void)
+{
+	printf(
+"client - access memory through 'memtool daemon'\n"
+"\n"
+"Usage: client [-bwlq] [-s SOCKET] [-u] [-n COUNT] ADDR[=VALUE]...\n"
+"\n"
+"Read ADDR, or write VALUE to ADDR, as one batch.\n"
+"\n"
+"Options:\n"
+"  -b          byte access\n"
+"  -w          word access (16 bit)\n"
+"  -l          long access (32 bit)\n"
+"  -q          quad access (64 bit)\n"
+"  -s <SOCKET> daemon socket (default " MD_SOCKET ")\n"
+"  -u          use the socket instead of the shared memory ring\n"
+"  -n <COUNT>  repeat the batch COUNT times and print the mean latency\n"
+	);
+}
+
+static int cmd_client(int argc, char **argv)
+{
+	const char *sock_path = MD_SOCKET;
+	struct md_req req[MD_RING_SLOTS];
+	struct timespec t0, t1;
+	struct mc_conn mc;
+	int width = 4, ring = 1, count = 1;
+	int opt, i, nr = 0, ret = 0;
+	char *end;
+	double us;
+
+	while ((opt = getopt(argc, argv, "bwlqs:un:h")) != -1) {
+		switch (opt) {
+		case 'b':
+			width = 1;
+			break;
+		case 'w':
+			width = 2;
+			break;
+		case 'l':
+			width = 4;
+			break;
+		case 'q':
+			width = 8;
+			break;
+		case 's':
+			sock_path = optarg;
+			break;
+		case 'u':
+			ring = 0;
+			break;
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 'h':
+			usage_client();
+			return 0;
+		}
+	}
+
+	if (optind >= argc || count < 1) {
+		usage_client();
+		return 1;
+	}
+
+	for (; optind < argc && nr < MD_RING_SLOTS; optind++, nr++) {
+		memset(&req[nr], 0, sizeof(req[nr]));
+		req[nr].width = width;
+		req[nr].addr = strtoull_suffix(argv[optind], &end, 0);
+		if (*end == '=') {
+			req[nr].op = MD_OP_WRITE;
+			req[nr].val = strtoull(end + 1, NULL, 0);
+		}
+	}
+
+	if (mc_connect(&mc, sock_path, ring)) {
+		perror("connect");
+		return 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < count; i++) {
+		if (mc_batch(&mc, req, nr)) {
+			perror("request");
+			return 1;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	for (i = 0; i < nr; i++) {
+		if (req[i].status) {
+			printf("%08llx: %s\n", (unsigned long long)req[i].addr,
+			       strerror(-req[i].status));
+			ret = 1;
+		} else if (req[i].op == MD_OP_READ) {
+			printf("%08llx: %0*llx\n", (unsigned long long)req[i].addr,
+			       width * 2, (unsigned long long)req[i].val);
+		}
+	}
+
+	if (count > 1) {
+		us = ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) /
+		     1e3 / count;
+		printf("%d batches over the %s, %.2f us per batch\n", count,
+		       mc.ring ? "ring" : "socket", us);
+	}
+
+	return ret;
+}
+
 struct cmd {
 	int (*cmd)(int argc, char **argv);
 	const char *name;
 };
 
-#define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
 
 static struct cmd cmds[] = {
 	{
@@ -457,6 +1719,12 @@ static struct cmd cmds[] = {
 	}, {
 		.cmd = cmd_memory_write,
 		.name = "mw",
+	}, {
+		.cmd = cmd_daemon,
+		.name = "daemon",
+	}, {
+		.cmd = cmd_client,
+		.name = "client",
 	},
 };
 
@@ -470,6 +1738,8 @@ static void usage(void)
 "memtool is divided into subcommands. Supported commands are:\n"
 "md: memory display, Show regions of memory\n"
 "mw: memory write, write values to memory\n"
+"daemon: keep memory mapped and serve accesses to local clients\n"
+"client: read or write memory through the daemon\n"
 "\n"
 "To show help for a subcommand do 'memtool <cmd> -h'\n"
 "\n"
@@ -0,0 +1,680 @@
+/*
+ * pci-demo-bench - throughput and latency benchmark for /dev/pci-demo
+ *
+ * Drives the pci-demo driver through each of its data paths from 1..N
+ * threads in 1..N processes and prints the results as JSON. It works
+ * against the real card as well as the fake_bar backend of pci-demo-dma,
+ * the read modes against any file.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <linux/perf_event.h>
+
+#include "pci-demo.h"
+
+#define MAX_SIZES	32
+
+enum mode {
+	MODE_READ,	/* sequential pread() */
+	MODE_RAND,	/* pread() at random, size aligned offsets */
+	MODE_HIPRI,	/* sequential preadv2(RWF_HIPRI), polled completion */
+	MODE_SPLICE,	/* splice() into a pipe drained to /dev/null */
+	MODE_RING,	/* consume the mmap'ed capture ring in place */
+	MODE_MAX,
+};
+
+static const char *mode_names[MODE_MAX] = {
+	[MODE_READ]	= "read",
+	[MODE_RAND]	= "rand",
+	[MODE_HIPRI]	= "hipri",
+	[MODE_SPLICE]	= "splice",
+	[MODE_RING]	= "ring",
+};
+
+struct config {
+	const char *file;
+	enum mode mode;
+	const char *method;
+	uint32_t flags;
+	size_t sizes[MAX_SIZES];
+	int nr_sizes;
+	size_t region;
+	unsigned long ops;
+	int threads;
+	int procs;
+};
+
+/* one per worker thread, lives in memory shared across fork() */
+struct result {
+	uint64_t ops;
+	uint64_t bytes;
+	uint64_t start_ns;
+	uint64_t end_ns;
+	uint64_t cpu_ns;
+	uint64_t cycles;
+	uint64_t drops;
+	int have_cycles;
+	int err;
+};
+
+struct worker {
+	const struct config *cfg;
+	size_t size;
+	int id;
+	struct result *res;
+	uint64_t *lat;
+	pthread_barrier_t *barrier;
+
+	int fd;
+	int cycles_fd;
+	char *buf;
+	off_t off;
+	off_t span;
+	unsigned int seed;
+	int pipefd[2];
+	int null_fd;
+	uint8_t *ring;
+	size_t ring_len;
+	uint32_t tail;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* user + system time of the calling thread */
+static uint64_t rusage_ns(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_THREAD, &ru);
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ULL +
+		(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ULL;
+}
+
+/* cycles of the calling thread, user and kernel, -1 if not permitted */
+static int cycles_open(void)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = PERF_COUNT_HW_CPU_CYCLES;
+	attr.exclude_hv = 1;
+
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/*
+ * Like strtoull() but handles an optional G, M, K or k
+ * suffix for Gigabyte, Megabyte or Kilobyte
+ */
+static unsigned long long strtoull_suffix(const char *str, char **endp, int base)
+{
+	unsigned long long val;
+	char *end;
+
+	val = strtoull(str, &end, base);
+
+	switch (*end) {
+	case 'G':
+		val *= 1024;
+	case 'M':
+		val *= 1024;
+	case 'k':
+	case 'K':
+		val *= 1024;
+		end++;
+	default:
+		break;
+	}
+
+	if (endp)
+		*endp = (char *)end;
+
+	return val;
+}
+
+static int parse_sizes(struct config *cfg, const char *str)
+{
+	char *end;
+
+	cfg->nr_sizes = 0;
+	while (*str) {
+		if (cfg->nr_sizes == MAX_SIZES)
+			return -1;
+		cfg->sizes[cfg->nr_sizes] = strtoull_suffix(str, &end, 0);
+		if (end == str || !cfg->sizes[cfg->nr_sizes])
+			return -1;
+		cfg->nr_sizes++;
+		str = end;
+		if (*str == ',')
+			str++;
+		else if (*str)
+			return -1;
+	}
+	return cfg->nr_sizes ? 0 : -1;
+}
+
+static int open_device(const struct config *cfg)
+{
+	int fd;
+
+	fd = open(cfg->file, O_RDWR);
+	if (fd < 0)
+		fd = open(cfg->file, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	/* regular files do not know about the driver's flags */
+	if (cfg->flags && ioctl(fd, PCI_DEMO_IOC_SET_FLAGS, &cfg->flags) &&
+	    errno != ENOTTY) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int ring_map(struct worker *w)
+{
+	long pagesize = sysconf(_SC_PAGE_SIZE);
+	struct pci_demo_ring_hdr *hdr;
+
+	/* the first page tells how large the whole ring is */
+	hdr = mmap(NULL, pagesize, PROT_READ, MAP_SHARED, w->fd, 0);
+	if (hdr == MAP_FAILED)
+		return errno;
+	if (hdr->magic != PCI_DEMO_RING_MAGIC) {
+		munmap(hdr, pagesize);
+		return EINVAL;
+	}
+	w->ring_len = hdr->data_offset + (size_t)hdr->nr_slots * hdr->slot_size;
+	munmap(hdr, pagesize);
+
+	w->ring = mmap(NULL, w->ring_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+		       w->fd, 0);
+	if (w->ring == MAP_FAILED) {
+		w->ring = NULL;
+		return errno;
+	}
+
+	/* skip whatever was captured before we started */
+	hdr = (struct pci_demo_ring_hdr *)w->ring;
+	w->tail = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+	__atomic_store_n(&hdr->tail, w->tail, __ATOMIC_RELEASE);
+	w->res->drops = hdr->drops;
+	return 0;
+}
+
+/* consume one ring slot in place, the latency is from fill to consume */
+static ssize_t ring_op(struct worker *w, uint64_t *lat)
+{
+	struct pci_demo_ring_hdr *hdr = (struct pci_demo_ring_hdr *)w->ring;
+	struct pollfd pfd = { .fd = w->fd, .events = POLLIN };
+	struct pci_demo_ring_slot *slot;
+	const uint64_t *p;
+	uint64_t sum = 0;
+	struct timespec ts;
+	uint8_t *data;
+	size_t i;
+
+	while (__atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE) == w->tail) {
+		if (poll(&pfd, 1, 1000) <= 0) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+	}
+
+	i = w->tail & (hdr->nr_slots - 1);
+	slot = &hdr->slots[i];
+	data = w->ring + hdr->data_offset + i * hdr->slot_size;
+	for (p = (const uint64_t *)data, i = 0; i < slot->len / 8; i++)
+		sum += p[i];
+	__asm__ __volatile__("" : : "r" (sum));
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	*lat = ts.tv_sec * 1000000000ULL + ts.tv_nsec - slot->tstamp;
+
+	__atomic_store_n(&hdr->tail, ++w->tail, __ATOMIC_RELEASE);
+	return slot->len;
+}
+
+static ssize_t splice_op(struct worker *w)
+{
+	loff_t pos = w->off;
+	ssize_t n, m, done = 0;
+
+	while (done < w->size) {
+		n = splice(w->fd, &pos, w->pipefd[1], NULL, w->size - done,
+			   SPLICE_F_MOVE);
+		if (n <= 0)
+			return done ? done : n;
+		while (n > 0) {
+			m = splice(w->pipefd[0], NULL, w->null_fd, NULL, n,
+				   SPLICE_F_MOVE);
+			if (m <= 0)
+				return -1;
+			n -= m;
+			done += m;
+		}
+	}
+	return done;
+}
+
+static int worker_setup(struct worker *w)
+{
+	const struct config *cfg = w->cfg;
+
+	w->fd = open_device(cfg);
+	if (w->fd < 0)
+		return errno;
+
+	if (cfg->mode == MODE_RING)
+		return ring_map(w);
+
+	w->buf = aligned_alloc(4096, (w->size + 4095) & ~4095UL);
+	if (!w->buf)
+		return ENOMEM;
+
+	if (cfg->mode == MODE_SPLICE) {
+		w->null_fd = open("/dev/null", O_WRONLY);
+		if (w->null_fd < 0 || pipe(w->pipefd))
+			return errno;
+		fcntl(w->pipefd[1], F_SETPIPE_SZ, (int)w->size);
+	}
+
+	/* workers start in different places of the region */
+	w->span = cfg->region > w->size ? cfg->region / w->size : 1;
+	w->off = (off_t)(w->id % w->span) * w->size;
+	w->seed = w->id + 1;
+	return 0;
+}
+
+static void worker_cleanup(struct worker *w)
+{
+	if (w->ring)
+		munmap(w->ring, w->ring_len);
+	if (w->null_fd >= 0)
+		close(w->null_fd);
+	if (w->pipefd[0] >= 0) {
+		close(w->pipefd[0]);
+		close(w->pipefd[1]);
+	}
+	if (w->cycles_fd >= 0)
+		close(w->cycles_fd);
+	if (w->fd >= 0)
+		close(w->fd);
+	free(w->buf);
+}
+
+static void *worker_thread(void *arg)
+{
+	struct worker *w = arg;
+	const struct config *cfg = w->cfg;
+	struct result *res = w->res;
+	struct iovec iov;
+	unsigned long i;
+	uint64_t t, cpu;
+	ssize_t n;
+
+	memset(res, 0, sizeof(*res));
+	w->fd = w->cycles_fd = w->null_fd = -1;
+	w->pipefd[0] = w->pipefd[1] = -1;
+
+	res->err = worker_setup(w);
+	w->cycles_fd = cycles_open();
+	iov.iov_base = w->buf;
+	iov.iov_len = w->size;
+
+	pthread_barrier_wait(w->barrier);
+	if (res->err)
+		goto out;
+
+	res->start_ns = now_ns();
+	cpu = rusage_ns();
+	if (w->cycles_fd >= 0)
+		ioctl(w->cycles_fd, PERF_EVENT_IOC_RESET, 0);
+
+	for (i = 0; i < cfg->ops; i++) {
+		if (cfg->mode == MODE_RAND)
+			w->off = (off_t)(rand_r(&w->seed) % w->span) * w->size;
+		else if (w->off + w->size > cfg->region)
+			w->off = 0;
+
+		t = now_ns();
+		switch (cfg->mode) {
+		case MODE_RING:
+			n = ring_op(w, &t);
+			break;
+		case MODE_HIPRI:
+			n = preadv2(w->fd, &iov, 1, w->off, RWF_HIPRI);
+			break;
+		case MODE_SPLICE:
+			n = splice_op(w);
+			break;
+		default:
+			n = pread(w->fd, w->buf, w->size, w->off);
+			break;
+		}
+		w->lat[i] = cfg->mode == MODE_RING ? t : now_ns() - t;
+
+		if (n <= 0) {
+			res->err = n ? errno : EIO;
+			break;
+		}
+		w->off += n;
+		res->bytes += n;
+		res->ops++;
+	}
+
+	if (w->cycles_fd >= 0 &&
+	    read(w->cycles_fd, &res->cycles, sizeof(res->cycles)) ==
+	    sizeof(res->cycles))
+		res->have_cycles = 1;
+	res->cpu_ns = rusage_ns() - cpu;
+	res->end_ns = now_ns();
+	if (w->ring)
+		res->drops = ((struct pci_demo_ring_hdr *)w->ring)->drops -
+			     res->drops;
+out:
+	worker_cleanup(w);
+	return NULL;
+}
+
+/* run cfg->threads workers in this process, the first one has index base */
+static void run_process(const struct config *cfg, size_t size, int base,
+			struct result *res, uint64_t *lat,
+			pthread_barrier_t *barrier)
+{
+	struct worker w[cfg->threads];
+	pthread_t tid[cfg->threads];
+	int i;
+
+	for (i = 0; i < cfg->threads; i++) {
+		memset(&w[i], 0, sizeof(w[i]));
+		w[i].cfg = cfg;
+		w[i].size = size;
+		w[i].id = base + i;
+		w[i].res = &res[base + i];
+		w[i].lat = &lat[(size_t)(base + i) * cfg->ops];
+		w[i].barrier = barrier;
+		pthread_create(&tid[i], NULL, worker_thread, &w[i]);
+	}
+	for (i = 0; i < cfg->threads; i++)
+		pthread_join(tid[i], NULL);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(const uint64_t *v, size_t n, double p)
+{
+	size_t i;
+
+	if (!n)
+		return 0;
+	i = (size_t)(p / 100.0 * (n - 1) + 0.5);
+	return v[i];
+}
+
+static void report(const struct config *cfg, size_t size, struct result *res,
+		   uint64_t *lat, int first)
+{
+	int nr = cfg->threads * cfg->procs;
+	uint64_t ops = 0, bytes = 0, cpu = 0, cycles = 0, drops = 0;
+	uint64_t start = UINT64_MAX, end = 0;
+	int have_cycles = 1, err = 0;
+	double secs;
+	size_t n = 0;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		/* compact the valid latencies to the front */
+		memmove(&lat[n], &lat[(size_t)i * cfg->ops],
+			res[i].ops * sizeof(*lat));
+		n += res[i].ops;
+		ops += res[i].ops;
+		bytes += res[i].bytes;
+		cpu += res[i].cpu_ns;
+		cycles += res[i].cycles;
+		drops += res[i].drops;
+		have_cycles &= res[i].have_cycles;
+		if (res[i].err && !err)
+			err = res[i].err;
+		if (res[i].ops && res[i].start_ns < start)
+			start = res[i].start_ns;
+		if (res[i].end_ns > end)
+			end = res[i].end_ns;
+	}
+	qsort(lat, n, sizeof(*lat), cmp_u64);
+	secs = ops && end > start ? (end - start) / 1e9 : 0.0;
+
+	printf("%s\n    {\n", first ? "" : ",");
+	printf("      \"size\": %zu,\n", size);
+	printf("      \"ops\": %llu,\n", (unsigned long long)ops);
+	printf("      \"bytes\": %llu,\n", (unsigned long long)bytes);
+	printf("      \"seconds\": %.6f,\n", secs);
+	printf("      \"mb_per_s\": %.2f,\n", secs ? bytes / secs / 1e6 : 0.0);
+	printf("      \"ops_per_s\": %.0f,\n", secs ? ops / secs : 0.0);
+	printf("      \"latency_ns\": { \"min\": %llu, \"p50\": %llu, "
+	       "\"p90\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu },\n",
+	       (unsigned long long)(n ? lat[0] : 0),
+	       (unsigned long long)percentile(lat, n, 50),
+	       (unsigned long long)percentile(lat, n, 90),
+	       (unsigned long long)percentile(lat, n, 99),
+	       (unsigned long long)percentile(lat, n, 99.9),
+	       (unsigned long long)(n ? lat[n - 1] : 0));
+	printf("      \"cpu_ns_per_byte\": %.4f,\n",
+	       bytes ? (double)cpu / bytes : 0.0);
+	if (have_cycles && bytes)
+		printf("      \"cycles_per_byte\": %.4f,\n",
+		       (double)cycles / bytes);
+	else
+		printf("      \"cycles_per_byte\": null,\n");
+	if (cfg->mode == MODE_RING)
+		printf("      \"drops\": %llu,\n", (unsigned long long)drops);
+	if (err)
+		printf("      \"error\": \"%s\"\n", strerror(err));
+	else
+		printf("      \"error\": null\n");
+	printf("    }");
+}
+
+static int run_size(const struct config *cfg, size_t size, int first)
+{
+	int nr = cfg->threads * cfg->procs;
+	size_t len = sizeof(pthread_barrier_t) + nr * sizeof(struct result) +
+		     (size_t)nr * cfg->ops * sizeof(uint64_t);
+	pthread_barrierattr_t attr;
+	pthread_barrier_t *barrier;
+	struct result *res;
+	uint64_t *lat;
+	void *shm;
+	pid_t pid;
+	int i;
+
+	shm = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shm == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	barrier = shm;
+	res = (struct result *)(barrier + 1);
+	lat = (uint64_t *)(res + nr);
+
+	pthread_barrierattr_init(&attr);
+	pthread_barrierattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_barrier_init(barrier, &attr, nr);
+
+	for (i = 0; i < cfg->procs; i++) {
+		pid = fork();
+		if (pid < 0) {
+			perror("fork");
+			exit(1);
+		}
+		if (!pid) {
+			run_process(cfg, size, i * cfg->threads, res, lat, barrier);
+			_exit(0);
+		}
+	}
+	while (wait(NULL) > 0)
+		;
+
+	report(cfg, size, res, lat, first);
+	pthread_barrier_destroy(barrier);
+	munmap(shm, len);
+	return 0;
+}
+
+static void usage(void)
+{
+	printf(
+"pci-demo-bench - benchmark the pci-demo driver\n"
+"\n"
+"Usage: pci-demo-bench [OPTIONS]\n"
+"\n"
+"Options:\n"
+"  -d <FILE>    device or file to test (default /dev/pci-demo)\n"
+"  -m <MODE>    read, rand, hipri, splice or ring (default read)\n"
+"  -s <SIZES>   comma separated transfer sizes (default 512,4k,64k)\n"
+"  -r <SIZE>    size of the region to read from (default 1M)\n"
+"  -n <OPS>     operations per worker (default 10000)\n"
+"  -t <N>       threads per process (default 1)\n"
+"  -p <N>       processes (default 1)\n"
+"  -M <METHOD>  auto, pio or dma transfers (default auto)\n"
+"  -P           busy poll for DMA completions\n"
+"\n"
+"Sizes can have a k, M or G suffix. The ring mode uses one worker and\n"
+"reports the latency from the driver filling a slot to its consumption.\n"
+"Results are printed as JSON.\n"
+	);
+}
+
+int main(int argc, char **argv)
+{
+	struct config cfg = {
+		.file = "/dev/pci-demo",
+		.mode = MODE_READ,
+		.method = "auto",
+		.region = 1024 * 1024,
+		.ops = 10000,
+		.threads = 1,
+		.procs = 1,
+	};
+	int opt, i;
+
+	parse_sizes(&cfg, "512,4k,64k");
+
+	while ((opt = getopt(argc, argv, "d:m:s:r:n:t:p:M:Ph")) != -1) {
+		switch (opt) {
+		case 'd':
+			cfg.file = optarg;
+			break;
+		case 'm':
+			for (i = 0; i < MODE_MAX; i++)
+				if (!strcmp(optarg, mode_names[i]))
+					break;
+			if (i == MODE_MAX) {
+				fprintf(stderr, "unknown mode: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			cfg.mode = i;
+			break;
+		case 's':
+			if (parse_sizes(&cfg, optarg)) {
+				fprintf(stderr, "could not parse: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'r':
+			cfg.region = strtoull_suffix(optarg, NULL, 0);
+			break;
+		case 'n':
+			cfg.ops = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			cfg.threads = atoi(optarg);
+			break;
+		case 'p':
+			cfg.procs = atoi(optarg);
+			break;
+		case 'M':
+			cfg.method = optarg;
+			if (!strcmp(optarg, "pio"))
+				cfg.flags |= PCI_DEMO_F_PIO;
+			else if (!strcmp(optarg, "dma"))
+				cfg.flags |= PCI_DEMO_F_DMA;
+			else if (strcmp(optarg, "auto")) {
+				fprintf(stderr, "unknown method: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'P':
+			cfg.flags |= PCI_DEMO_F_POLL;
+			break;
+		case 'h':
+		default:
+			usage();
+			return opt == 'h' ? 0 : EXIT_FAILURE;
+		}
+	}
+
+	if (cfg.threads < 1 || cfg.procs < 1 || !cfg.ops || !cfg.region) {
+		usage();
+		return EXIT_FAILURE;
+	}
+	if (cfg.mode == MODE_RING) {
+		/* there is one ring and one consumer */
+		cfg.threads = cfg.procs = 1;
+		cfg.nr_sizes = 1;
+		cfg.sizes[0] = 0;
+	}
+
+	printf("{\n");
+	printf("  \"file\": \"%s\",\n", cfg.file);
+	printf("  \"mode\": \"%s\",\n", mode_names[cfg.mode]);
+	printf("  \"method\": \"%s\",\n", cfg.method);
+	printf("  \"poll\": %s,\n", cfg.flags & PCI_DEMO_F_POLL ? "true" : "false");
+	printf("  \"threads\": %d,\n", cfg.threads);
+	printf("  \"procs\": %d,\n", cfg.procs);
+	printf("  \"ops_per_worker\": %lu,\n", cfg.ops);
+	printf("  \"results\": [");
+	fflush(stdout);
+
+	for (i = 0; i < cfg.nr_sizes; i++) {
+		if (run_size(&cfg, cfg.sizes[i], !i))
+			return EXIT_FAILURE;
+		fflush(stdout);
+	}
+
+	printf("\n  ]\n}\n");
+	return 0;
+}
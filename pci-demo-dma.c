@@ -24,118 +24,2155 @@
 #include <linux/dma-mapping.h>
 #include <linux/wait.h>
 #include <linux/slab.h>
+#include <linux/uio.h>
+#include <linux/bvec.h>
+#include <linux/bitmap.h>
+#include <linux/workqueue.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
+#include <linux/kthread.h>
+#include <linux/delay.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/random.h>
+#include <linux/vmalloc.h>
+#include <linux/kref.h>
+
+#include "pci-demo.h"
 
 #define DEVNAME		"pci-demo"
 #define DEVMAJOR	224
 
-#define BUF_SIZE	(1*1024*1024)
+static int dma_enabled = 0;
+static dma_addr_t src_phys;
+static struct dma_chan *dma_chan = NULL;
+static struct device *dma_dev = NULL;	/* NULL for the software engine */
+
+static DECLARE_WAIT_QUEUE_HEAD(wq);
+
+/*
+ * Bounce buffers are handed out in slots, so that several transfers
+ * (e.g. a queue of io_uring reads) can be in flight at once.
+ */
+static DECLARE_WAIT_QUEUE_HEAD(slot_wq);
+
+struct pci_demo_pool;
+
+/* one transfer from BAR0 into a bounce slot */
+struct pci_demo_xfer {
+	void *buf;
+	dma_addr_t buf_phys;
+	struct pci_demo_pool *pool;
+	int slot;
+	int streaming;		/* slot needs dma_sync_single_*() */
+	loff_t pos;
+	size_t len;
+	dma_cookie_t cookie;
+	int finished;
+	/* busy poll the channel instead of waiting for the callback */
+	int poll;
+	u64 start_ns;
+	u64 done_ns;
+	/* called from the DMA callback instead of waking up wq */
+	void (*complete)(struct pci_demo_xfer *xfer);
+	struct list_head node;	/* software engine queue */
+	int coalesce;		/* COAL_*, set by the submitter */
+	int irq;		/* submitted with DMA_PREP_INTERRUPT */
+	struct list_head coal_node;
+};
+
+/* an AIO / io_uring read waiting for its DMA to complete */
+struct pci_demo_req {
+	struct pci_demo_xfer xfer;
+	struct kiocb *iocb;
+	struct page **pages;
+	struct bio_vec *bvec;
+	unsigned int nr_pages;
+	struct iov_iter iter;
+	struct work_struct work;
+};
+
+struct pci_demo_dev {
+	unsigned long memaddr;
+	void __iomem *membase;
+	unsigned long memlen;
+	struct pci_dev *dev;
+	int fake;		/* BAR0 is plain memory, see fake_bar */
+	struct class *class;
+	struct device *device;
+};
+
+static struct pci_demo_dev demo;
+
+/*
+ * Sequential read-ahead: once a file reads sequentially, the next window
+ * of slot sized chunks is DMA'd in the background, so that later reads
+ * find their data already landed. The window doubles whenever a reader
+ * had to wait for a chunk still in flight, and collapses on a seek.
+ */
+#define RA_MAX		8
+
+static unsigned int ra_max = 4;
+module_param(ra_max, uint, 0644);
+MODULE_PARM_DESC(ra_max, "maximum read-ahead window in bounce slots, 0 disables");
+
+static atomic_long_t ra_hits;
+static atomic_long_t ra_misses;
+static atomic_long_t ra_issued;
+static atomic_long_t ra_wasted;
+
+struct pci_demo_ra {
+	struct pci_demo_xfer xfer[RA_MAX];
+	unsigned int first;
+	unsigned int nr;
+	unsigned int window;
+	bool late;
+	loff_t next;		/* where a sequential read would start */
+};
+
+/* per open file state */
+struct pci_demo_file {
+	u32 flags;		/* PCI_DEMO_F_* */
+	struct mutex lock;	/* serializes the read-ahead state */
+	struct pci_demo_ra ra;
+	struct list_head node;	/* on pf_list */
+};
+
+/* open files, teardown takes their read-ahead slots back */
+static LIST_HEAD(pf_list);
+static DEFINE_MUTEX(pf_list_lock);
+
+/*
+ * Hybrid polling: a polled transfer spins on the channel status for about
+ * as long as recent transfers of that size took to complete, then falls
+ * back to sleeping. The mean completion time is learned per size bucket.
+ */
+static unsigned int poll_max_us = 50;
+module_param(poll_max_us, uint, 0644);
+MODULE_PARM_DESC(poll_max_us, "upper bound of the busy poll budget");
+
+#define POLL_BUCKETS	8	/* 512 bytes .. 64k and larger */
+
+static u64 poll_mean_ns[POLL_BUCKETS];
+
+/*
+ * Streaming capture ring, see pci-demo.h. A kernel thread stands in for
+ * the device and copies BAR0 into the next free slot every ring_period_us.
+ */
+static unsigned int ring_slots = 64;
+module_param(ring_slots, uint, 0444);
+MODULE_PARM_DESC(ring_slots, "number of capture ring slots, 0 disables the ring");
+
+static unsigned int ring_slot_size = 64*1024;
+module_param(ring_slot_size, uint, 0444);
+MODULE_PARM_DESC(ring_slot_size, "capture ring slot size in bytes");
+
+static unsigned int ring_period_us = 1000;
+module_param(ring_period_us, uint, 0644);
+MODULE_PARM_DESC(ring_period_us, "interval between two filled ring slots");
+
+struct pci_demo_ring {
+	struct pci_demo_ring_hdr *hdr;
+	unsigned int hdr_order;
+	unsigned int slot_order;
+	unsigned int nr_slots;
+	unsigned int slot_size;
+	size_t data_offset;	/* the header copy is user writable */
+	struct page **slot_pages;
+	dma_addr_t *slot_phys;
+	u32 head;
+	loff_t pos;
+	int users;		/* mappings, they outlive the device */
+	bool dead;		/* torn down, the last munmap frees it */
+	struct task_struct *thread;
+	struct mutex lock;
+	wait_queue_head_t wait;
+	struct fasync_struct *fasync;
+};
+
+static struct pci_demo_ring ring = {
+	.lock	= __MUTEX_INITIALIZER(ring.lock),
+	.wait	= __WAIT_QUEUE_HEAD_INITIALIZER(ring.wait),
+};
+
+/*
+ * The bounce buffer pool. Slots are carved out of node local chunks of up
+ * to 2MB: a compound huge page mapped for streaming DMA where the page
+ * allocator has one, dma_alloc_coherent() (and so CMA) or vmalloc()
+ * otherwise. Resizing builds a new pool and swaps it in; the old one is
+ * freed once the last slot taken from it comes back.
+ */
+#define POOL_CHUNK_MAX	(2*1024*1024)
+#define POOL_SLOT_MAX	(4*1024*1024)
+#define POOL_SLOTS_MAX	1024
+
+static unsigned int pool_slot_size = 64*1024;
+module_param(pool_slot_size, uint, 0444);
+MODULE_PARM_DESC(pool_slot_size, "initial bounce slot size in bytes, also the largest single transfer");
+
+static unsigned int pool_slots = 16;
+module_param(pool_slots, uint, 0444);
+MODULE_PARM_DESC(pool_slots, "initial number of bounce slots");
+
+struct pci_demo_chunk {
+	void *virt;
+	dma_addr_t phys;
+	size_t size;
+	struct page *page;	/* streaming mapped pages */
+};
+
+struct pci_demo_pool {
+	struct kref ref;	/* one for being current, one per busy slot */
+	unsigned int slot_size;
+	unsigned int nr_slots;
+	unsigned int slots_per_chunk;
+	unsigned int nr_chunks;
+	unsigned long *map;
+	struct pci_demo_chunk chunks[];
+};
+
+static struct pci_demo_pool *cur_pool;
+static DEFINE_SPINLOCK(pool_lock);
+static DEFINE_MUTEX(pool_mutex);	/* serializes resizing */
+static atomic_t pools_alive;
+
+static int chunk_alloc(struct pci_demo_chunk *c, size_t size, int node)
+{
+	gfp_t gfp = GFP_KERNEL | __GFP_COMP | __GFP_NOWARN | __GFP_NORETRY;
+	unsigned int order = get_order(size);
+
+	if (node != NUMA_NO_NODE)
+		gfp |= __GFP_THISNODE;
+
+	c->size = size;
+	c->page = alloc_pages_node(node, gfp, order);
+	if (c->page) {
+		c->virt = page_address(c->page);
+		if (!dma_dev)
+			return 0;
+		c->phys = dma_map_page(dma_dev, c->page, 0, size, DMA_FROM_DEVICE);
+		if (!dma_mapping_error(dma_dev, c->phys))
+			return 0;
+		__free_pages(c->page, order);
+		c->page = NULL;
+	}
+
+	if (dma_dev)
+		c->virt = dma_alloc_coherent(dma_dev, size, &c->phys, GFP_KERNEL);
+	else
+		c->virt = vzalloc_node(size, node);
+	return c->virt ? 0 : -ENOMEM;
+}
+
+static void chunk_free(struct pci_demo_chunk *c)
+{
+	if (!c->virt)
+		return;
+
+	if (c->page) {
+		if (dma_dev)
+			dma_unmap_page(dma_dev, c->phys, c->size, DMA_FROM_DEVICE);
+		__free_pages(c->page, get_order(c->size));
+	} else if (dma_dev) {
+		dma_free_coherent(dma_dev, c->size, c->virt, c->phys);
+	} else {
+		vfree(c->virt);
+	}
+}
+
+static void pool_release(struct kref *ref)
+{
+	struct pci_demo_pool *p = container_of(ref, struct pci_demo_pool, ref);
+	unsigned int i;
+
+	for (i = 0; i < p->nr_chunks; i++)
+		chunk_free(&p->chunks[i]);
+	bitmap_free(p->map);
+	kfree(p);
+
+	atomic_dec(&pools_alive);
+	wake_up(&slot_wq);
+}
+
+static void pool_put(struct pci_demo_pool *p)
+{
+	kref_put(&p->ref, pool_release);
+}
+
+static struct pci_demo_pool *pool_get(void)
+{
+	struct pci_demo_pool *p;
+
+	spin_lock(&pool_lock);
+	p = cur_pool;
+	if (p)
+		kref_get(&p->ref);
+	spin_unlock(&pool_lock);
+	return p;
+}
+
+static struct pci_demo_pool *pool_create(unsigned int slot_size,
+				unsigned int nr_slots)
+{
+	int node = demo.dev ? dev_to_node(&demo.dev->dev) : NUMA_NO_NODE;
+	unsigned int nr_chunks, spc, i;
+	struct pci_demo_pool *p;
+	size_t chunk_size;
+
+	slot_size = PAGE_ALIGN(slot_size);
+	if (!slot_size || slot_size > POOL_SLOT_MAX ||
+	    !nr_slots || nr_slots > POOL_SLOTS_MAX)
+		return ERR_PTR(-EINVAL);
+
+	spc = max_t(unsigned int, POOL_CHUNK_MAX / slot_size, 1);
+	spc = min(spc, nr_slots);
+	chunk_size = (size_t)spc * slot_size;
+	nr_chunks = DIV_ROUND_UP(nr_slots, spc);
+
+	p = kzalloc_node(struct_size(p, chunks, nr_chunks), GFP_KERNEL, node);
+	if (!p)
+		return ERR_PTR(-ENOMEM);
+	p->map = bitmap_zalloc(nr_slots, GFP_KERNEL);
+	if (!p->map) {
+		kfree(p);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	kref_init(&p->ref);
+	p->slot_size = slot_size;
+	p->nr_slots = nr_slots;
+	p->slots_per_chunk = spc;
+	p->nr_chunks = nr_chunks;
+	atomic_inc(&pools_alive);
+
+	for (i = 0; i < nr_chunks; i++) {
+		if (chunk_alloc(&p->chunks[i], chunk_size, node)) {
+			pool_put(p);
+			return ERR_PTR(-ENOMEM);
+		}
+	}
+	return p;
+}
+
+/* install a new pool, the old one goes away with its last busy slot */
+static int pool_resize(unsigned int slot_size, unsigned int nr_slots)
+{
+	struct pci_demo_pool *p, *old;
+
+	mutex_lock(&pool_mutex);
+	p = pool_create(slot_size, nr_slots);
+	if (IS_ERR(p)) {
+		mutex_unlock(&pool_mutex);
+		return PTR_ERR(p);
+	}
+
+	spin_lock(&pool_lock);
+	old = cur_pool;
+	cur_pool = p;
+	spin_unlock(&pool_lock);
+	mutex_unlock(&pool_mutex);
+
+	if (old)
+		pool_put(old);
+	/* waiters of the old pool retry on the new one */
+	wake_up(&slot_wq);
+	return 0;
+}
+
+static void ra_drain_all(void);
+
+static void pool_destroy(void)
+{
+	struct pci_demo_pool *old;
+
+	spin_lock(&pool_lock);
+	old = cur_pool;
+	cur_pool = NULL;
+	spin_unlock(&pool_lock);
+
+	if (old)
+		pool_put(old);
+	/* readers waiting for a slot give up and drop their file lock */
+	wake_up(&slot_wq);
+	/* open files would keep their read-ahead slots until release */
+	ra_drain_all();
+	wait_event(slot_wq, !atomic_read(&pools_alive));
+}
+
+static bool slot_try(struct pci_demo_pool *p, struct pci_demo_xfer *xfer)
+{
+	struct pci_demo_chunk *c;
+	unsigned int slot;
+
+	for (;;) {
+		slot = find_first_zero_bit(p->map, p->nr_slots);
+		if (slot >= p->nr_slots)
+			return false;
+		if (!test_and_set_bit(slot, p->map))
+			break;
+	}
+
+	c = &p->chunks[slot / p->slots_per_chunk];
+	xfer->pool = p;
+	xfer->slot = slot;
+	xfer->streaming = c->page && dma_dev;
+	xfer->buf = c->virt + (slot % p->slots_per_chunk) * p->slot_size;
+	xfer->buf_phys = c->phys + (slot % p->slots_per_chunk) * p->slot_size;
+	return true;
+}
+
+/*
+ * Take a bounce slot. A speculative caller only gets one while at least
+ * half of the pool is free, so read-ahead never makes real reads wait.
+ */
+static int slot_get(struct pci_demo_xfer *xfer, bool nowait, bool spec)
+{
+	struct pci_demo_pool *p;
+
+	for (;;) {
+		p = pool_get();
+		if (!p)
+			return -ENODEV;
+
+		if (spec && bitmap_weight(p->map, p->nr_slots) >= p->nr_slots / 2)
+			break;
+		if (slot_try(p, xfer))
+			return 0;
+		if (nowait || spec)
+			break;
+
+		if (wait_event_interruptible(slot_wq,
+				!bitmap_full(p->map, p->nr_slots) ||
+				READ_ONCE(cur_pool) != p)) {
+			pool_put(p);
+			return -ERESTARTSYS;
+		}
+		pool_put(p);
+	}
+
+	pool_put(p);
+	return -EAGAIN;
+}
+
+static void slot_put(struct pci_demo_xfer *xfer)
+{
+	clear_bit(xfer->slot, xfer->pool->map);
+	smp_mb__after_atomic();
+	wake_up(&slot_wq);
+	pool_put(xfer->pool);
+}
+
+static inline size_t slot_size(struct pci_demo_xfer *xfer)
+{
+	return xfer->pool->slot_size;
+}
+
+static int pci_demo_open(struct inode * inode, struct file * file)
+{
+	struct pci_demo_file *pf;
+
+	pf = kzalloc(sizeof(*pf), GFP_KERNEL);
+	if (!pf)
+		return -ENOMEM;
+
+	mutex_init(&pf->lock);
+	mutex_lock(&pf_list_lock);
+	list_add(&pf->node, &pf_list);
+	mutex_unlock(&pf_list_lock);
+	file->private_data = pf;
+	file->f_mode |= FMODE_NOWAIT;
+	return 0;
+}
+
+static ssize_t pci_demo_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	size_t count = iov_iter_count(from);
+
+	printk("pci-demo: hello world %zu\n", count);
+	iov_iter_advance(from, count);
+	return count;
+}
+
+/* complete a transfer, from its own callback or reaped with others */
+static void dma_xfer_done(struct pci_demo_xfer *xfer, bool wake)
+{
+	void (*complete)(struct pci_demo_xfer *xfer) = xfer->complete;
+
+	if (xfer->streaming)
+		dma_sync_single_for_cpu(dma_dev, xfer->buf_phys, xfer->len,
+					DMA_FROM_DEVICE);
+	/* a synchronous waiter may free xfer as soon as it sees finished */
+	if (complete) {
+		complete(xfer);
+		return;
+	}
+	xfer->done_ns = ktime_get_ns();
+	WRITE_ONCE(xfer->finished, 1);
+	if (wake)
+		wake_up(&wq);
+}
+
+static void dma_tx_callback(void *dma_async_param);
+
+/*
+ * Memory backed fake BAR0 and software DMA engine, so that the whole
+ * driver can be exercised and benchmarked without the board. The engine
+ * thread retires queued transfers in order. Each one takes its size at
+ * fake_dma_mbps once fake_dma_lat_us have passed since its submission,
+ * plus up to fake_dma_jitter_us of random jitter.
+ */
+static unsigned long fake_bar = 0;
+module_param(fake_bar, ulong, 0444);
+MODULE_PARM_DESC(fake_bar, "size of a memory backed BAR0 used instead of the PCI device, 0 disables");
+
+static bool fake_dma = true;
+module_param(fake_dma, bool, 0444);
+MODULE_PARM_DESC(fake_dma, "read the fake BAR through the software DMA engine");
+
+static unsigned int fake_dma_mbps = 2000;
+module_param(fake_dma_mbps, uint, 0644);
+MODULE_PARM_DESC(fake_dma_mbps, "software DMA bandwidth in MB/s");
+
+static unsigned int fake_dma_lat_us = 5;
+module_param(fake_dma_lat_us, uint, 0644);
+MODULE_PARM_DESC(fake_dma_lat_us, "software DMA completion latency");
+
+static unsigned int fake_dma_jitter_us = 0;
+module_param(fake_dma_jitter_us, uint, 0644);
+MODULE_PARM_DESC(fake_dma_jitter_us, "maximum random jitter added to a software DMA completion");
+
+struct soft_dma {
+	spinlock_t lock;
+	struct list_head queue;
+	wait_queue_head_t wait;
+	struct task_struct *thread;
+	dma_cookie_t last_used;
+	dma_cookie_t last_done;
+	u64 busy_ns;		/* when the previous transfer is done */
+};
+
+static struct soft_dma soft;
+
+static int soft_dma_submit(struct pci_demo_xfer *xfer)
+{
+	unsigned long flags;
+
+	xfer->start_ns = ktime_get_ns();
+	spin_lock_irqsave(&soft.lock, flags);
+	xfer->cookie = soft.last_used + 1;
+	if (xfer->cookie < DMA_MIN_COOKIE)
+		xfer->cookie = DMA_MIN_COOKIE;
+	soft.last_used = xfer->cookie;
+	list_add_tail(&xfer->node, &soft.queue);
+	spin_unlock_irqrestore(&soft.lock, flags);
+
+	wake_up(&soft.wait);
+	return 0;
+}
+
+static enum dma_status soft_dma_status(dma_cookie_t cookie)
+{
+	return dma_async_is_complete(cookie, smp_load_acquire(&soft.last_done),
+					READ_ONCE(soft.last_used));
+}
+
+static void soft_dma_sleep_until(u64 due)
+{
+	ktime_t expires = ns_to_ktime(due);
+	s64 left = due - ktime_get_ns();
+
+	if (left <= 0)
+		return;
+	if (left < 2 * NSEC_PER_USEC) {
+		while (ktime_get_ns() < due)
+			cpu_relax();
+		return;
+	}
+	set_current_state(TASK_UNINTERRUPTIBLE);
+	schedule_hrtimeout_range(&expires, 0, HRTIMER_MODE_ABS);
+}
+
+static int soft_dma_thread(void *data)
+{
+	struct pci_demo_xfer *xfer;
+	dma_cookie_t cookie;
+	u64 due;
+	int irq;
+
+	while (!kthread_should_stop()) {
+		spin_lock_irq(&soft.lock);
+		xfer = list_first_entry_or_null(&soft.queue,
+					struct pci_demo_xfer, node);
+		if (xfer)
+			list_del(&xfer->node);
+		spin_unlock_irq(&soft.lock);
+
+		if (!xfer) {
+			wait_event_interruptible(soft.wait,
+				!list_empty(&soft.queue) || kthread_should_stop());
+			continue;
+		}
+
+		due = max(soft.busy_ns, xfer->start_ns +
+				(u64)fake_dma_lat_us * NSEC_PER_USEC);
+		due += div_u64((u64)xfer->len * 1000, max(fake_dma_mbps, 1U));
+		if (fake_dma_jitter_us)
+			due += get_random_u32_below(fake_dma_jitter_us * NSEC_PER_USEC);
+		soft.busy_ns = due;
+		soft_dma_sleep_until(due);
+
+		memcpy(xfer->buf, (void __force *)demo.membase + xfer->pos,
+				xfer->len);
+
+		/* a polled waiter owns xfer again as soon as last_done moves */
+		cookie = xfer->cookie;
+		irq = xfer->irq && !xfer->poll;
+		smp_store_release(&soft.last_done, cookie);
+		if (irq)
+			dma_tx_callback(xfer);
+	}
+	return 0;
+}
+
+static int soft_dma_start(void)
+{
+	spin_lock_init(&soft.lock);
+	INIT_LIST_HEAD(&soft.queue);
+	init_waitqueue_head(&soft.wait);
+	soft.last_used = soft.last_done = DMA_MIN_COOKIE - 1;
+
+	soft.thread = kthread_run(soft_dma_thread, NULL, "pci-demo-dma");
+	if (IS_ERR(soft.thread)) {
+		soft.thread = NULL;
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+static void soft_dma_stop(void)
+{
+	if (soft.thread)
+		kthread_stop(soft.thread);
+	soft.thread = NULL;
+}
+
+/*
+ * Interrupt coalescing. Only the last transfer of a batch asks for a
+ * completion interrupt; the others wait on coal.pending, and since the
+ * channel completes in order, any later interrupt reaps all of them with
+ * a single wakeup. Independent asynchronous reads coalesce adaptively:
+ * their count threshold doubles while interrupts come less than
+ * coal_usecs apart and halves once they are more than four times that
+ * apart. An hrtimer reaps whatever is still pending coal_usecs after it
+ * was queued, e.g. when a batch was cut short by an error. Some engines
+ * only retire cookies from their irq handler, so when nothing completed
+ * since its last run the timer queues an interrupt descriptor behind the
+ * pending transfers. Engines without DMA_INTERRUPT do not coalesce.
+ */
+enum {
+	COAL_NONE,	/* always interrupt, someone waits for just this one */
+	COAL_BATCH,	/* more transfers of the same batch follow */
+	COAL_ADAPT,	/* independent transfer, coalesce under load */
+};
+
+static unsigned int coal_max_frames = 16;
+module_param(coal_max_frames, uint, 0644);
+MODULE_PARM_DESC(coal_max_frames, "most transfers completed by one interrupt, 1 disables coalescing");
+
+static unsigned int coal_usecs = 20;
+module_param(coal_usecs, uint, 0644);
+MODULE_PARM_DESC(coal_usecs, "longest a transfer waits for a coalesced completion");
+
+static atomic_long_t dma_descs;
+static atomic_long_t dma_irqs;
+static atomic_long_t dma_coalesced;
+static atomic_long_t dma_timer_reaped;
+
+struct pci_demo_coal {
+	spinlock_t lock;
+	struct list_head pending;	/* submitted without an interrupt */
+	unsigned int nr_pending;	/* since the last interrupt */
+	unsigned int frames;		/* adaptive threshold of COAL_ADAPT */
+	dma_cookie_t last_used;
+	dma_cookie_t last_done;		/* seen by the timer */
+	bool can_kick;			/* engine has DMA_INTERRUPT */
+	bool kicked;			/* interrupt descriptor queued */
+	u64 last_irq_ns;
+	struct hrtimer timer;
+};
+
+static struct pci_demo_coal coal;
+
+/*
+ * Submitters store their cookie after dmaengine_submit() returns, so the
+ * stores can come out of order. Only ever move last_used forward, with the
+ * wrap from INT_MAX back to DMA_MIN_COOKIE, or dma_async_is_complete()
+ * takes a newer cookie for an old completed one. Called with coal.lock.
+ */
+static void coal_raise(dma_cookie_t cookie)
+{
+	s64 d = (s64)cookie - coal.last_used;
+
+	if (d < 0)
+		d += INT_MAX;
+	if (d > 0 && d < INT_MAX / 2)
+		coal.last_used = cookie;
+}
+
+/* complete the pending transfers up to and including cookie */
+static unsigned int coal_reap(dma_cookie_t cookie)
+{
+	struct pci_demo_xfer *xfer, *tmp;
+	unsigned long flags;
+	unsigned int n = 0;
+	LIST_HEAD(done);
+
+	spin_lock_irqsave(&coal.lock, flags);
+	/* a completed cookie is used even if its submitter is not done yet */
+	coal_raise(cookie);
+	list_for_each_entry_safe(xfer, tmp, &coal.pending, coal_node) {
+		if (dma_async_is_complete(xfer->cookie, cookie,
+					coal.last_used) != DMA_COMPLETE)
+			continue;
+		list_move_tail(&xfer->coal_node, &done);
+		n++;
+	}
+	spin_unlock_irqrestore(&coal.lock, flags);
+
+	list_for_each_entry_safe(xfer, tmp, &done, coal_node) {
+		list_del(&xfer->coal_node);
+		dma_xfer_done(xfer, false);
+	}
+	if (n)
+		wake_up(&wq);
+	return n;
+}
+
+static void coal_adapt(void)
+{
+	u64 now = ktime_get_ns();
+	u64 gap = now - READ_ONCE(coal.last_irq_ns);
+	u64 target = (u64)coal_usecs * NSEC_PER_USEC;
+	unsigned int frames = READ_ONCE(coal.frames);
+
+	/* racy updates only cost some accuracy, like poll_update() */
+	WRITE_ONCE(coal.last_irq_ns, now);
+	if (gap < target)
+		frames = min(frames * 2, max(coal_max_frames, 1U));
+	else if (gap > 4 * target)
+		frames = max(frames / 2, 1U);
+	WRITE_ONCE(coal.frames, frames);
+}
+
+static void dma_tx_callback(void *dma_async_param)
+{
+	struct pci_demo_xfer *xfer = dma_async_param;
+
+	/* everything queued before it without an interrupt is done as well */
+	atomic_long_add(coal_reap(xfer->cookie), &dma_coalesced);
+	coal_adapt();
+	dma_xfer_done(xfer, true);
+}
+
+static dma_cookie_t coal_done(void)
+{
+	dma_cookie_t done, used;
+
+	if (demo.fake)
+		return smp_load_acquire(&soft.last_done);
+	dma_async_is_tx_complete(dma_chan, READ_ONCE(coal.last_used),
+				&done, &used);
+	return done;
+}
+
+static void coal_kick_callback(void *param)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&coal.lock, flags);
+	coal.kicked = false;
+	spin_unlock_irqrestore(&coal.lock, flags);
+	atomic_long_add(coal_reap(coal_done()), &dma_coalesced);
+}
+
+/* queue an interrupt behind the pending transfers, the channel is in order */
+static void coal_kick(void)
+{
+	struct dma_async_tx_descriptor *tx;
+
+	tx = dmaengine_prep_dma_interrupt(dma_chan,
+				DMA_PREP_INTERRUPT|DMA_CTRL_ACK);
+	if (!tx)
+		goto fail;
+	tx->callback = coal_kick_callback;
+	if (dma_submit_error(dmaengine_submit(tx)))
+		goto fail;
+	atomic_long_inc(&dma_irqs);
+	dma_async_issue_pending(dma_chan);
+	return;
+
+fail:
+	/* the next run tries again */
+	spin_lock_irq(&coal.lock);
+	coal.kicked = false;
+	spin_unlock_irq(&coal.lock);
+}
+
+static enum hrtimer_restart coal_timer_fn(struct hrtimer *timer)
+{
+	dma_cookie_t done = coal_done();
+	bool more, kick = false;
+
+	atomic_long_add(coal_reap(done), &dma_timer_reaped);
+
+	spin_lock_irq(&coal.lock);
+	more = !list_empty(&coal.pending);
+	if (more && !demo.fake && !coal.kicked && done == coal.last_done) {
+		coal.kicked = true;
+		kick = true;
+	}
+	coal.last_done = done;
+	spin_unlock_irq(&coal.lock);
+	if (!more)
+		return HRTIMER_NORESTART;
+	if (kick)
+		coal_kick();
+
+	hrtimer_forward_now(timer, us_to_ktime(max(coal_usecs, 1U)));
+	return HRTIMER_RESTART;
+}
+
+static void coal_init(void)
+{
+	spin_lock_init(&coal.lock);
+	INIT_LIST_HEAD(&coal.pending);
+	coal.frames = 1;
+	hrtimer_init(&coal.timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+	coal.timer.function = coal_timer_fn;
+}
+
+static int dma_copy(struct pci_demo_xfer *xfer)
+{
+	struct dma_async_tx_descriptor *tx = NULL;
+	unsigned long flags;
+	unsigned int limit;
+
+	xfer->finished = 0;
+	xfer->done_ns = 0;
+
+	spin_lock_irqsave(&coal.lock, flags);
+	if (xfer->coalesce == COAL_BATCH)
+		limit = coal_max_frames;
+	else if (xfer->coalesce == COAL_ADAPT)
+		limit = coal.frames;
+	else
+		limit = 1;
+	/* nothing could make the engine retire a transfer without one */
+	if (!demo.fake && !coal.can_kick)
+		limit = 1;
+	xfer->irq = xfer->poll || coal.nr_pending + 1 >= limit;
+	coal.nr_pending = xfer->irq ? 0 : coal.nr_pending + 1;
+	spin_unlock_irqrestore(&coal.lock, flags);
+
+	if (demo.fake) {
+		soft_dma_submit(xfer);
+		goto queued;
+	}
+
+	if (xfer->streaming)
+		dma_sync_single_for_device(dma_dev, xfer->buf_phys, xfer->len,
+					DMA_FROM_DEVICE);
+
+	tx = dmaengine_prep_dma_memcpy(dma_chan, xfer->buf_phys,
+				src_phys + xfer->pos, xfer->len,
+				xfer->irq ? DMA_PREP_INTERRUPT|DMA_CTRL_ACK :
+					DMA_CTRL_ACK);
+	if (!tx) {
+		printk(KERN_ERR"pci-demo: failed to request dma tx\n");
+		return -EIO;
+	}
+
+	/*
+	 * A polled transfer still asks for an interrupt, some engines only
+	 * retire cookies from their irq handler, but has no callback, so the
+	 * waiter never depends on a wakeup and owns xfer once it is complete.
+	 */
+	if (!xfer->poll && xfer->irq) {
+		tx->callback = dma_tx_callback;
+		tx->callback_param = xfer;
+	}
+	xfer->start_ns = ktime_get_ns();
+	xfer->cookie = dmaengine_submit(tx);
+	if (dma_submit_error(xfer->cookie)) {
+		printk(KERN_ERR"pci-demo: failed to do dma tx submit\n");
+		return -EIO;
+	}
+
+queued:
+	/*
+	 * An interrupt that comes before xfer is on the list misses it, the
+	 * timer picks it up then.
+	 */
+	spin_lock_irqsave(&coal.lock, flags);
+	coal_raise(xfer->cookie);
+	if (!xfer->irq) {
+		list_add_tail(&xfer->coal_node, &coal.pending);
+		if (!hrtimer_is_queued(&coal.timer))
+			hrtimer_start(&coal.timer,
+				us_to_ktime(max(coal_usecs, 1U)),
+				HRTIMER_MODE_REL_SOFT);
+	}
+	spin_unlock_irqrestore(&coal.lock, flags);
+
+	atomic_long_inc(&dma_descs);
+	if (xfer->irq)
+		atomic_long_inc(&dma_irqs);
+
+	if (!demo.fake)
+		dma_async_issue_pending(dma_chan);
+	return 0;
+}
+
+static unsigned int poll_bucket(size_t len)
+{
+	int b = fls(len - 1) - 9;
+
+	return clamp(b, 0, POLL_BUCKETS - 1);
+}
+
+static void poll_update(size_t len, u64 ns)
+{
+	unsigned int b = poll_bucket(len);
+	u64 mean = READ_ONCE(poll_mean_ns[b]);
+
+	/* ewma with weight 1/8, racy updates only cost some accuracy */
+	mean = mean ? mean - (mean >> 3) + (ns >> 3) : ns;
+	WRITE_ONCE(poll_mean_ns[b], mean);
+}
+
+static enum dma_status dma_poll_status(struct pci_demo_xfer *xfer)
+{
+	enum dma_status status;
+
+	if (demo.fake)
+		status = soft_dma_status(xfer->cookie);
+	else
+		status = dma_async_is_tx_complete(dma_chan, xfer->cookie,
+						NULL, NULL);
+	if (status != DMA_IN_PROGRESS && !xfer->done_ns)
+		xfer->done_ns = ktime_get_ns();
+	return status;
+}
+
+/* wait for a transfer started with dma_copy() */
+static int dma_wait(struct pci_demo_xfer *xfer)
+{
+	enum dma_status status = DMA_COMPLETE;
+	u64 budget, mean, deadline;
+	unsigned long sleep_us;
+
+	if (!xfer->poll) {
+		wait_event(wq, READ_ONCE(xfer->finished));
+		goto out;
+	}
+
+	mean = READ_ONCE(poll_mean_ns[poll_bucket(xfer->len)]);
+	budget = (u64)poll_max_us * NSEC_PER_USEC;
+	if (mean && mean + mean / 2 < budget)
+		budget = mean + mean / 2;
+
+	deadline = xfer->start_ns + budget;
+	while ((status = dma_poll_status(xfer)) == DMA_IN_PROGRESS &&
+	       ktime_get_ns() < deadline)
+		cpu_relax();
+
+	/* the budget was too small for this one, sleep in growing steps */
+	sleep_us = max_t(unsigned long, div_u64(mean, 2 * NSEC_PER_USEC), 10);
+	while (status == DMA_IN_PROGRESS) {
+		usleep_range(sleep_us, sleep_us + sleep_us / 4);
+		sleep_us = min_t(unsigned long, sleep_us * 2, 1000);
+		status = dma_poll_status(xfer);
+	}
+
+	if (xfer->streaming)
+		dma_sync_single_for_cpu(dma_dev, xfer->buf_phys, xfer->len,
+					DMA_FROM_DEVICE);
+out:
+	if (xfer->done_ns)
+		poll_update(xfer->len, xfer->done_ns - xfer->start_ns);
+	return status == DMA_COMPLETE ? 0 : -EIO;
+}
+
+/*
+ * Transfer strategy calibration. PIO, a single DMA and a DMA split into
+ * CAL_DEPTH pipelined descriptors are timed for every power of two size
+ * from 512 bytes up to the slot size; synchronous reads then use the
+ * fastest one for their size. Runs at probe time and on writes to the
+ * calibrate sysfs attribute, the results are in calibration.
+ */
+enum {
+	XFER_PIO,
+	XFER_DMA,
+	XFER_DMA_PIPE,
+	XFER_METHODS,
+};
+
+static const char * const xfer_method_names[XFER_METHODS] = {
+	[XFER_PIO]	= "pio",
+	[XFER_DMA]	= "dma",
+	[XFER_DMA_PIPE]	= "dma-pipe",
+};
+
+#define CAL_BUCKETS	14	/* 512 bytes .. 4MB */
+#define CAL_ITERS	8
+#define CAL_DEPTH	4
+
+static bool calibrate = true;
+module_param(calibrate, bool, 0444);
+MODULE_PARM_DESC(calibrate, "time PIO and DMA at probe and pick the faster one per transfer size");
+
+struct cal_entry {
+	u64 ns[XFER_METHODS];	/* 0 if not measured */
+	int method;
+};
+
+static struct cal_entry cal_table[CAL_BUCKETS];
+static bool cal_valid;
+static DEFINE_MUTEX(cal_mutex);
+
+static unsigned int cal_bucket(size_t len)
+{
+	int b = fls(len) - 10;
+
+	return clamp(b, 0, CAL_BUCKETS - 1);
+}
+
+/* split one slot transfer into up to CAL_DEPTH descriptors in flight */
+static int dma_copy_pipelined(struct pci_demo_xfer *xfer)
+{
+	struct pci_demo_xfer sub[CAL_DEPTH];
+	size_t chunk = ALIGN(DIV_ROUND_UP(xfer->len, CAL_DEPTH), 64);
+	unsigned int i, n;
+	size_t off;
+	int ret = 0, err;
+
+	for (n = 0, off = 0; off < xfer->len; n++, off += chunk) {
+		sub[n] = *xfer;
+		sub[n].buf += off;
+		sub[n].buf_phys += off;
+		sub[n].pos += off;
+		sub[n].len = min(chunk, xfer->len - off);
+		sub[n].complete = NULL;
+		sub[n].coalesce = off + chunk < xfer->len ? COAL_BATCH : COAL_NONE;
+		ret = dma_copy(&sub[n]);
+		if (ret)
+			break;
+	}
+
+	for (i = 0; i < n; i++) {
+		err = dma_wait(&sub[i]);
+		if (err && !ret)
+			ret = err;
+	}
+	return ret;
+}
+
+/* fill a slot from BAR0 with the given method and wait for it */
+static int xfer_fill(struct pci_demo_xfer *xfer, int method)
+{
+	int ret;
+
+	switch (method) {
+	case XFER_PIO:
+		memcpy_fromio(xfer->buf, demo.membase + xfer->pos, xfer->len);
+		return 0;
+	case XFER_DMA_PIPE:
+		return dma_copy_pipelined(xfer);
+	default:
+		ret = dma_copy(xfer);
+		if (!ret)
+			ret = dma_wait(xfer);
+		return ret;
+	}
+}
+
+static int xfer_method(size_t len)
+{
+	if (!dma_enabled)
+		return XFER_PIO;
+	if (!READ_ONCE(cal_valid))
+		return XFER_DMA;
+	return cal_table[cal_bucket(len)].method;
+}
+
+static int pci_demo_calibrate(void)
+{
+	struct pci_demo_xfer xfer = { };
+	struct cal_entry *e;
+	unsigned int b, m, i;
+	u64 start;
+	int ret;
+
+	if (!dma_enabled)
+		return -ENODEV;
+
+	mutex_lock(&cal_mutex);
+	ret = slot_get(&xfer, false, false);
+	if (ret)
+		goto out;
+
+	WRITE_ONCE(cal_valid, false);
+	for (b = 0; b < CAL_BUCKETS; b++) {
+		e = &cal_table[b];
+		memset(e, 0, sizeof(*e));
+		xfer.pos = 0;
+		xfer.len = 512 << b;
+		/* too large to measure, keep what worked for smaller sizes */
+		if (xfer.len > slot_size(&xfer) || xfer.len > demo.memlen) {
+			e->method = b ? cal_table[b - 1].method : XFER_DMA;
+			continue;
+		}
+
+		for (m = 0; m < XFER_METHODS; m++) {
+			ret = xfer_fill(&xfer, m);	/* warm up */
+			start = ktime_get_ns();
+			for (i = 0; i < CAL_ITERS && !ret; i++)
+				ret = xfer_fill(&xfer, m);
+			if (ret)
+				goto out_put;
+			e->ns[m] = div_u64(ktime_get_ns() - start, CAL_ITERS);
+			if (e->ns[m] < e->ns[e->method])
+				e->method = m;
+		}
+	}
+	WRITE_ONCE(cal_valid, true);
+
+out_put:
+	slot_put(&xfer);
+out:
+	mutex_unlock(&cal_mutex);
+	return ret;
+}
+
+static void pci_demo_req_work(struct work_struct *work)
+{
+	struct pci_demo_req *req = container_of(work, struct pci_demo_req, work);
+	struct kiocb *iocb = req->iocb;
+	long ret = req->xfer.len;
+
+	if (copy_to_iter(req->xfer.buf, req->xfer.len, &req->iter) != req->xfer.len)
+		ret = -EFAULT;
+	else
+		iocb->ki_pos += ret;
+
+	if (req->nr_pages)
+		unpin_user_pages_dirty_lock(req->pages, req->nr_pages, true);
+	kvfree(req->pages);
+	kfree(req->bvec);
+	slot_put(&req->xfer);
+	kfree(req);
+
+	iocb->ki_complete(iocb, ret);
+}
+
+/* runs in the DMA callback, the copy to user pages may sleep */
+static void pci_demo_req_complete(struct pci_demo_xfer *xfer)
+{
+	struct pci_demo_req *req = container_of(xfer, struct pci_demo_req, xfer);
+
+	schedule_work(&req->work);
+}
+
+/*
+ * Pin (FOLL_PIN) the user pages behind the iter and describe them with a
+ * bvec iter, since the copy out of the bounce slot happens later from a
+ * worker outside the caller's mm.
+ */
+static ssize_t req_pin_pages(struct pci_demo_req *req, struct iov_iter *to,
+			     size_t count, gfp_t gfp)
+{
+	size_t start, left, len;
+	unsigned int i;
+	ssize_t ret;
+
+	ret = iov_iter_extract_pages(to, &req->pages, count, UINT_MAX, 0, &start);
+	if (ret <= 0) {
+		kvfree(req->pages);
+		req->pages = NULL;
+		return ret ? ret : -EFAULT;
+	}
+	count = ret;
+	req->nr_pages = DIV_ROUND_UP(start + count, PAGE_SIZE);
+
+	req->bvec = kcalloc(req->nr_pages, sizeof(*req->bvec), gfp);
+	if (!req->bvec) {
+		unpin_user_pages(req->pages, req->nr_pages);
+		kvfree(req->pages);
+		iov_iter_revert(to, count);
+		return -ENOMEM;
+	}
+	for (i = 0, left = count; i < req->nr_pages; i++, start = 0) {
+		len = min_t(size_t, left, PAGE_SIZE - start);
+		bvec_set_page(&req->bvec[i], req->pages[i], len, start);
+		left -= len;
+	}
+	iov_iter_bvec(&req->iter, ITER_DEST, req->bvec, req->nr_pages, count);
+	return count;
+}
+
+/*
+ * Queue a single slot sized DMA transfer and complete the kiocb from the
+ * DMA callback. Bvec iters, e.g. io_uring fixed buffers, are used as they
+ * are, the submitter keeps those pages until the kiocb completes.
+ */
+static ssize_t pci_demo_read_async(struct kiocb *iocb, struct iov_iter *to,
+				size_t count)
+{
+	bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+	gfp_t gfp = nowait ? GFP_NOWAIT : GFP_KERNEL;
+	struct pci_demo_req *req;
+	ssize_t ret;
+
+	/* pinning user pages may fault them in and sleep */
+	if (nowait && !iov_iter_is_bvec(to))
+		return -EAGAIN;
+
+	req = kzalloc(sizeof(*req), gfp);
+	if (!req)
+		return nowait ? -EAGAIN : -ENOMEM;
+
+	ret = slot_get(&req->xfer, nowait, false);
+	if (ret)
+		goto out_free;
+
+	count = min_t(size_t, count, slot_size(&req->xfer));
+	if (iov_iter_is_bvec(to)) {
+		req->iter = *to;
+		iov_iter_truncate(&req->iter, count);
+		iov_iter_advance(to, count);
+	} else {
+		ret = req_pin_pages(req, to, count, gfp);
+		if (ret < 0)
+			goto out_slot;
+		count = ret;
+	}
+
+	req->iocb = iocb;
+	req->xfer.pos = iocb->ki_pos;
+	req->xfer.len = count;
+	req->xfer.complete = pci_demo_req_complete;
+	req->xfer.coalesce = COAL_ADAPT;
+	INIT_WORK(&req->work, pci_demo_req_work);
+
+	ret = dma_copy(&req->xfer);
+	if (ret)
+		goto out_unpin;
+	return -EIOCBQUEUED;
+
+out_unpin:
+	kfree(req->bvec);
+	if (req->nr_pages)
+		unpin_user_pages(req->pages, req->nr_pages);
+	kvfree(req->pages);
+	iov_iter_revert(to, count);
+out_slot:
+	slot_put(&req->xfer);
+out_free:
+	kfree(req);
+	return ret;
+}
+
+static void ra_pop(struct pci_demo_ra *ra, bool wasted)
+{
+	struct pci_demo_xfer *e = &ra->xfer[ra->first];
+
+	if (!READ_ONCE(e->finished))
+		dma_wait(e);
+	slot_put(e);
+	ra->first = (ra->first + 1) % RA_MAX;
+	ra->nr--;
+	if (wasted)
+		atomic_long_inc(&ra_wasted);
+}
+
+static void ra_drop(struct pci_demo_ra *ra)
+{
+	while (ra->nr)
+		ra_pop(ra, true);
+	ra->window = 0;
+}
+
+/* with no pool installed, ra_fill() cannot take the slots again */
+static void ra_drain_all(void)
+{
+	struct pci_demo_file *pf;
 
-static int dma_enabled = 0;
-static dma_addr_t *dma_buf = NULL;
-static dma_addr_t dma_phys;
-static dma_addr_t src_phys;
+	mutex_lock(&pf_list_lock);
+	list_for_each_entry(pf, &pf_list, node) {
+		mutex_lock(&pf->lock);
+		ra_drop(&pf->ra);
+		mutex_unlock(&pf->lock);
+	}
+	mutex_unlock(&pf_list_lock);
+}
 
-static volatile int dma_finished = 0;
-static DECLARE_WAIT_QUEUE_HEAD(wq);
+static void ra_fill(struct pci_demo_ra *ra)
+{
+	struct pci_demo_xfer *e;
+	loff_t pos = ra->next;
 
-struct pci_demo_dev {
-	unsigned long memaddr;
-	void __iomem *membase;
-	unsigned long memlen;
-	struct pci_dev *dev;
+	if (ra->nr) {
+		e = &ra->xfer[(ra->first + ra->nr - 1) % RA_MAX];
+		pos = e->pos + e->len;
+	}
+
+	while (ra->nr < ra->window && pos < demo.memlen) {
+		e = &ra->xfer[(ra->first + ra->nr) % RA_MAX];
+		memset(e, 0, sizeof(*e));
+		/* never make other readers wait for our speculation */
+		if (slot_get(e, true, true)) {
+			ra->window = ra->nr;
+			break;
+		}
+		e->pos = pos;
+		e->len = min_t(size_t, slot_size(e), demo.memlen - pos);
+		/* the window is filled as one batch */
+		if (ra->nr + 1 < ra->window && pos + e->len < demo.memlen)
+			e->coalesce = COAL_BATCH;
+		if (dma_copy(e)) {
+			slot_put(e);
+			break;
+		}
+		ra->nr++;
+		pos += e->len;
+		atomic_long_inc(&ra_issued);
+	}
+}
+
+/*
+ * Serve the start of a read from the read-ahead window. Returns the number
+ * of bytes copied, 0 if the position is not covered by the window.
+ */
+static ssize_t ra_read(struct pci_demo_ra *ra, loff_t pos,
+				struct iov_iter *to, size_t count)
+{
+	struct pci_demo_xfer *e;
+	size_t off, n;
+
+	/* the reader skipped over these */
+	while (ra->nr && pos >= ra->xfer[ra->first].pos + ra->xfer[ra->first].len) {
+		ra_pop(ra, true);
+		ra->window /= 2;
+	}
+	if (!ra->nr || pos < ra->xfer[ra->first].pos)
+		return 0;
+
+	e = &ra->xfer[ra->first];
+	if (!READ_ONCE(e->finished)) {
+		ra->late = true;
+		dma_wait(e);
+	}
+
+	off = pos - e->pos;
+	n = min_t(size_t, count, e->len - off);
+	if (copy_to_iter(e->buf + off, n, to) != n)
+		return -EFAULT;
+	if (off + n == e->len)
+		ra_pop(ra, false);
+	atomic_long_inc(&ra_hits);
+	return n;
+}
+
+static void ra_update(struct pci_demo_ra *ra, loff_t start, loff_t end)
+{
+	unsigned int max = min_t(unsigned int, ra_max, RA_MAX);
+
+	if (start == ra->next && max) {
+		if (!ra->window)
+			ra->window = min_t(unsigned int, 2, max);
+		else if (ra->late)
+			ra->window = min_t(unsigned int, ra->window * 2, max);
+	} else {
+		ra_drop(ra);
+	}
+	ra->late = false;
+	ra->next = end;
+	ra_fill(ra);
+}
+
+static ssize_t pci_demo_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct pci_demo_file *pf = iocb->ki_filp->private_data;
+	bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+	struct pci_demo_xfer xfer = { };
+	size_t count = iov_iter_count(to);
+	ssize_t ret = 0, done = 0;
+	loff_t start = iocb->ki_pos;
+	bool use_dma = dma_enabled && !(pf->flags & PCI_DEMO_F_PIO);
+	int method;
+
+	if (!demo.membase)
+		return -EIO;
+
+	if (iocb->ki_pos >= demo.memlen || !count)
+		return 0;
+	count = min_t(size_t, count, demo.memlen - iocb->ki_pos);
+
+	if (use_dma) {
+		if (!is_sync_kiocb(iocb) &&
+		    (user_backed_iter(to) || iov_iter_is_bvec(to)))
+			return pci_demo_read_async(iocb, to, count);
+		/* a synchronous DMA always sleeps for its completion */
+		if (nowait)
+			return -EAGAIN;
+		mutex_lock(&pf->lock);
+	}
+
+	while (done < count) {
+		if (use_dma) {
+			ret = ra_read(&pf->ra, iocb->ki_pos, to, count - done);
+			if (ret < 0)
+				break;
+			if (ret) {
+				iocb->ki_pos += ret;
+				done += ret;
+				continue;
+			}
+			if (pf->ra.window)
+				atomic_long_inc(&ra_misses);
+		}
+
+		ret = slot_get(&xfer, nowait, false);
+		if (ret)
+			break;
+
+		xfer.pos = iocb->ki_pos;
+		xfer.len = min_t(size_t, count - done, slot_size(&xfer));
+		xfer.poll = (iocb->ki_flags & IOCB_HIPRI) ||
+				(pf->flags & PCI_DEMO_F_POLL);
+		if (!use_dma)
+			method = XFER_PIO;
+		else if (pf->flags & PCI_DEMO_F_DMA)
+			method = XFER_DMA;
+		else
+			method = xfer_method(xfer.len);
+		ret = xfer_fill(&xfer, method);
+
+		if (!ret && copy_to_iter(xfer.buf, xfer.len, to) != xfer.len)
+			ret = -EFAULT;
+		slot_put(&xfer);
+		if (ret)
+			break;
+
+		iocb->ki_pos += xfer.len;
+		done += xfer.len;
+	}
+
+	if (use_dma) {
+		ra_update(&pf->ra, start, iocb->ki_pos);
+		mutex_unlock(&pf->lock);
+	}
+
+	return done ? done : ret;
+}
+
+static void pci_demo_pipe_buf_release(struct pipe_inode_info *pipe,
+				struct pipe_buffer *buf)
+{
+	put_page(buf->page);
+}
+
+static const struct pipe_buf_operations pci_demo_pipe_buf_ops = {
+	.release	= pci_demo_pipe_buf_release,
+	.try_steal	= generic_pipe_buf_try_steal,
+	.get		= generic_pipe_buf_get,
 };
 
-static struct pci_demo_dev demo;
+static void pci_demo_spd_release(struct splice_pipe_desc *spd, unsigned int i)
+{
+	put_page(spd->pages[i]);
+}
 
-static int pci_demo_open(struct inode * inode, struct file * file)
+/*
+ * DMA straight into freshly allocated pages and hand them to the pipe,
+ * so splice() and sendfile() never copy the data through a bounce slot.
+ */
+static ssize_t pci_demo_splice_read(struct file *in, loff_t *ppos,
+				struct pipe_inode_info *pipe, size_t len,
+				unsigned int flags)
 {
+	struct page *pages[PIPE_DEF_BUFFERS];
+	struct partial_page partial[PIPE_DEF_BUFFERS];
+	struct splice_pipe_desc spd = {
+		.pages		= pages,
+		.partial	= partial,
+		.nr_pages_max	= PIPE_DEF_BUFFERS,
+		.ops		= &pci_demo_pipe_buf_ops,
+		.spd_release	= pci_demo_spd_release,
+	};
+	struct pci_demo_xfer *xfer;
+	unsigned int i, n, mapped = 0, submitted = 0, good;
+	loff_t pos = *ppos;
+	ssize_t ret = 0;
+	int err = -EIO;
+
+	if (!demo.membase)
+		return -EIO;
+
+	if (pos >= demo.memlen || !len)
+		return 0;
+	len = min_t(size_t, len, demo.memlen - pos);
+
+	/* splice_grow_spd() is not exported, stay with the default array */
+	n = min_t(unsigned int, DIV_ROUND_UP(len, PAGE_SIZE), PIPE_DEF_BUFFERS);
+	n = min_t(unsigned int, n,
+		pipe->max_usage - pipe_occupancy(pipe->head, pipe->tail));
+	if (!n)
+		return 0;
+
+	xfer = kcalloc(n, sizeof(*xfer), GFP_KERNEL);
+	if (!xfer)
+		return -ENOMEM;
+
+	for (i = 0; i < n; i++) {
+		spd.pages[i] = alloc_page(GFP_KERNEL);
+		if (!spd.pages[i])
+			break;
+		xfer[i].buf = page_address(spd.pages[i]);
+		xfer[i].pos = pos + (loff_t)i * PAGE_SIZE;
+		xfer[i].len = min_t(size_t, len - i * PAGE_SIZE, PAGE_SIZE);
+		spd.partial[i].offset = 0;
+		spd.partial[i].len = xfer[i].len;
+	}
+	n = i;
+	if (!n) {
+		kfree(xfer);
+		return -ENOMEM;
+	}
+
+	if (dma_enabled) {
+		for (i = 0; i < n; i++) {
+			if (dma_dev) {
+				xfer[i].buf_phys = dma_map_page(dma_dev, spd.pages[i],
+						0, PAGE_SIZE, DMA_FROM_DEVICE);
+				if (dma_mapping_error(dma_dev, xfer[i].buf_phys))
+					break;
+			}
+			mapped++;
+			xfer[i].coalesce = i + 1 < n ? COAL_BATCH : COAL_NONE;
+			if (dma_copy(&xfer[i]))
+				break;
+			submitted++;
+		}
+		/* only the pages before the first failed transfer are good */
+		for (i = 0, good = submitted; i < submitted; i++) {
+			ret = dma_wait(&xfer[i]);
+			if (ret && i < good) {
+				good = i;
+				err = ret;
+			}
+		}
+		for (i = 0; dma_dev && i < mapped; i++)
+			dma_unmap_page(dma_dev, xfer[i].buf_phys, PAGE_SIZE,
+					DMA_FROM_DEVICE);
+	} else {
+		for (i = 0; i < n; i++)
+			memcpy_fromio(xfer[i].buf, demo.membase + xfer[i].pos,
+					xfer[i].len);
+		good = n;
+	}
+
+	/* never hand a page the device did not fill to the pipe */
+	for (i = good; i < n; i++)
+		put_page(spd.pages[i]);
+	spd.nr_pages = good;
+	if (good)
+		ret = splice_to_pipe(pipe, &spd);
+	else
+		ret = err;
+	if (ret > 0)
+		*ppos += ret;
+	kfree(xfer);
+	return ret;
+}
+
+static void ring_fill_one(void)
+{
+	struct pci_demo_ring_hdr *hdr = ring.hdr;
+	struct pci_demo_ring_slot *desc;
+	struct pci_demo_xfer xfer = { };
+	u32 head = ring.head;	/* never trust the user writable copy */
+	unsigned int idx;
+
+	if (head - smp_load_acquire(&hdr->tail) >= ring.nr_slots) {
+		WRITE_ONCE(hdr->drops, hdr->drops + 1);
+		return;
+	}
+
+	idx = head & (ring.nr_slots - 1);
+	if (ring.pos >= demo.memlen)
+		ring.pos = 0;
+	xfer.buf = page_address(ring.slot_pages[idx]);
+	xfer.pos = ring.pos;
+	xfer.len = min_t(size_t, ring.slot_size, demo.memlen - ring.pos);
+
+	if (dma_enabled) {
+		xfer.buf_phys = ring.slot_phys[idx];
+		if (dma_dev)
+			dma_sync_single_for_device(dma_dev, xfer.buf_phys,
+					ring.slot_size, DMA_FROM_DEVICE);
+		if (dma_copy(&xfer) || dma_wait(&xfer))
+			return;
+		if (dma_dev)
+			dma_sync_single_for_cpu(dma_dev, xfer.buf_phys,
+					ring.slot_size, DMA_FROM_DEVICE);
+	} else {
+		memcpy_fromio(xfer.buf, demo.membase + xfer.pos, xfer.len);
+	}
+
+	desc = &hdr->slots[idx];
+	desc->pos = xfer.pos;
+	desc->len = xfer.len;
+	desc->seq = head;
+	desc->tstamp = ktime_get_ns();
+	WRITE_ONCE(ring.head, head + 1);
+	smp_store_release(&hdr->head, head + 1);
+	ring.pos += xfer.len;
+
+	wake_up_interruptible(&ring.wait);
+	kill_fasync(&ring.fasync, SIGIO, POLL_IN);
+}
+
+static int ring_thread(void *data)
+{
+	while (!kthread_should_stop()) {
+		ring_fill_one();
+		usleep_range(ring_period_us, ring_period_us + ring_period_us / 8 + 1);
+	}
 	return 0;
 }
 
-static ssize_t pci_demo_write(struct file *file, const char __user *buf,
-				size_t count, loff_t *ppos)
+static void ring_unmap_dma(void)
 {
-	printk("pci-demo: hello world %ld\n", count);
-	return count;
+	unsigned int i;
+
+	for (i = 0; ring.slot_phys && i < ring.nr_slots; i++) {
+		if (dma_dev && ring.slot_phys[i])
+			dma_unmap_page(dma_dev, ring.slot_phys[i], ring.slot_size,
+					DMA_FROM_DEVICE);
+		ring.slot_phys[i] = 0;
+	}
 }
 
-static void dma_tx_callback(void *dma_async_param)
+static void ring_free(void)
 {
-	dma_finished = 1;
-	wake_up_interruptible(&wq);
+	unsigned int i;
+
+	ring_unmap_dma();
+	for (i = 0; ring.slot_pages && i < ring.nr_slots; i++)
+		if (ring.slot_pages[i])
+			__free_pages(ring.slot_pages[i], ring.slot_order);
+	kfree(ring.slot_phys);
+	kfree(ring.slot_pages);
+	ring.slot_phys = NULL;
+	ring.slot_pages = NULL;
+	if (ring.hdr)
+		free_pages((unsigned long)ring.hdr, ring.hdr_order);
+	ring.hdr = NULL;
 }
 
-static int dma_copy(size_t sz)
+static int ring_alloc(void)
 {
-	struct dma_chan *chan = NULL;
-	struct dma_device *dma_dev;
-	dma_cap_mask_t mask;
-	struct dma_async_tx_descriptor *tx = NULL;
-	dma_cookie_t cookie;
+	size_t hdr_size;
+	unsigned int i;
 
-	dma_cap_zero(mask);
-	dma_cap_set(DMA_MEMCPY, mask);
+	if (!ring_slots)
+		return 0;
 
-	chan = dma_request_channel(mask, NULL, NULL);
-	if (!chan) {
-		printk(KERN_ERR"pci-demo: dma channel request failed.\n");
-		return -1;
+	/* the ring of a previous probe is still mapped somewhere */
+	mutex_lock(&ring.lock);
+	if (ring.hdr) {
+		mutex_unlock(&ring.lock);
+		return -EBUSY;
 	}
-	dma_dev = chan->device;
+	ring.dead = false;
+	ring.head = 0;
+	ring.pos = 0;
+	mutex_unlock(&ring.lock);
 
-	dma_finished = 0;
-	tx = dma_dev->device_prep_dma_memcpy(chan, dma_phys, src_phys,
-						sz, DMA_PREP_INTERRUPT|DMA_CTRL_ACK);
-	if (!tx) {
-		printk(KERN_ERR"pci-demo: failed to request dma tx\n");
-		return -1;
+	ring.nr_slots = roundup_pow_of_two(ring_slots);
+	ring.slot_size = PAGE_ALIGN(ring_slot_size);
+	ring.slot_order = get_order(ring.slot_size);
+	hdr_size = PAGE_ALIGN(struct_size(ring.hdr, slots, ring.nr_slots));
+	ring.hdr_order = get_order(hdr_size);
+	ring.data_offset = hdr_size;
+
+	ring.hdr = (void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO, ring.hdr_order);
+	ring.slot_pages = kcalloc(ring.nr_slots, sizeof(*ring.slot_pages), GFP_KERNEL);
+	ring.slot_phys = kcalloc(ring.nr_slots, sizeof(*ring.slot_phys), GFP_KERNEL);
+	if (!ring.hdr || !ring.slot_pages || !ring.slot_phys)
+		goto fail;
+
+	for (i = 0; i < ring.nr_slots; i++) {
+		ring.slot_pages[i] = alloc_pages(GFP_KERNEL | __GFP_ZERO,
+						ring.slot_order);
+		if (!ring.slot_pages[i])
+			goto fail;
+		if (!dma_dev)
+			continue;
+		ring.slot_phys[i] = dma_map_page(dma_dev, ring.slot_pages[i], 0,
+					ring.slot_size, DMA_FROM_DEVICE);
+		if (dma_mapping_error(dma_dev, ring.slot_phys[i])) {
+			ring.slot_phys[i] = 0;
+			goto fail;
+		}
 	}
 
-	tx->callback = dma_tx_callback;
-	cookie = dmaengine_submit(tx);
-	if (dma_submit_error(cookie)) {
-		printk(KERN_ERR"pci-demo: failed to do dma tx submit\n");
+	ring.hdr->magic = PCI_DEMO_RING_MAGIC;
+	ring.hdr->nr_slots = ring.nr_slots;
+	ring.hdr->slot_size = ring.slot_size;
+	ring.hdr->data_offset = ring.data_offset;
+	printk(KERN_INFO"pci-demo: capture ring %u x %u bytes\n",
+			ring.nr_slots, ring.slot_size);
+	return 0;
+
+fail:
+	ring_free();
+	return -ENOMEM;
+}
+
+/* the producer only runs while somebody has the ring mapped */
+static void ring_get(void)
+{
+	if (!ring.users++ && !ring.dead) {
+		ring.thread = kthread_run(ring_thread, NULL, "pci-demo-ring");
+		if (IS_ERR(ring.thread)) {
+			printk(KERN_ERR"pci-demo: cannot start ring thread\n");
+			ring.thread = NULL;
+		}
+	}
+}
+
+static void pci_demo_vm_open(struct vm_area_struct *vma)
+{
+	mutex_lock(&ring.lock);
+	ring_get();
+	mutex_unlock(&ring.lock);
+}
+
+/* the PTEs hold no page references, so a dead ring is freed only here */
+static void pci_demo_vm_close(struct vm_area_struct *vma)
+{
+	mutex_lock(&ring.lock);
+	if (!--ring.users) {
+		if (ring.thread) {
+			kthread_stop(ring.thread);
+			ring.thread = NULL;
+		}
+		if (ring.dead)
+			ring_free();
+	}
+	mutex_unlock(&ring.lock);
+}
+
+static const struct vm_operations_struct pci_demo_vm_ops = {
+	.open	= pci_demo_vm_open,
+	.close	= pci_demo_vm_close,
+};
+
+static int pci_demo_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	unsigned long addr = vma->vm_start;
+	size_t size = vma->vm_end - vma->vm_start;
+	unsigned int i;
+	int ret = -EINVAL;
+
+	mutex_lock(&ring.lock);
+	if (!ring.hdr || ring.dead) {
+		ret = -ENODEV;
+		goto out;
+	}
+
+	/* a private mapping would need COW copies of the remapped pages */
+	if (!(vma->vm_flags & VM_MAYSHARE))
+		goto out;
+
+	/* a shorter mapping lets the consumer read the geometry first */
+	if (vma->vm_pgoff ||
+	    size > ring.data_offset + (size_t)ring.nr_slots * ring.slot_size)
+		goto out;
+
+	vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+	vm_flags_clear(vma, VM_MAYEXEC);
+	ret = remap_pfn_range(vma, addr, virt_to_phys(ring.hdr) >> PAGE_SHIFT,
+				min_t(size_t, size, ring.data_offset),
+				vma->vm_page_prot);
+	addr += ring.data_offset;
+	for (i = 0; !ret && i < ring.nr_slots && addr < vma->vm_end; i++) {
+		ret = remap_pfn_range(vma, addr, page_to_pfn(ring.slot_pages[i]),
+					min_t(size_t, ring.slot_size,
+					      vma->vm_end - addr),
+					vma->vm_page_prot);
+		addr += ring.slot_size;
+	}
+	if (!ret) {
+		vma->vm_ops = &pci_demo_vm_ops;
+		ring_get();
 	}
+out:
+	mutex_unlock(&ring.lock);
+	return ret;
+}
+
+static __poll_t pci_demo_poll(struct file *file, poll_table *wait)
+{
+	__poll_t mask = EPOLLOUT | EPOLLWRNORM;
+
+	if (!ring.hdr)
+		return mask | EPOLLIN | EPOLLRDNORM;
+
+	poll_wait(file, &ring.wait, wait);
+	if (READ_ONCE(ring.head) != READ_ONCE(ring.hdr->tail))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	return mask;
+}
+
+static int pci_demo_fasync(int fd, struct file *file, int on)
+{
+	return fasync_helper(fd, file, on, &ring.fasync);
+}
 
-	dma_async_issue_pending(chan);
-	wait_event_interruptible(wq, dma_finished);
+static int pci_demo_release(struct inode *inode, struct file *file)
+{
+	struct pci_demo_file *pf = file->private_data;
 
-	dma_release_channel(chan);
+	pci_demo_fasync(-1, file, 0);
+	mutex_lock(&pf_list_lock);
+	list_del(&pf->node);
+	mutex_unlock(&pf_list_lock);
+	ra_drop(&pf->ra);
+	kfree(pf);
 	return 0;
 }
 
-static ssize_t pci_demo_read(struct file * file, char __user * buf,
-				size_t count, loff_t *ppos)
+static long pci_demo_ioctl(struct file *file, unsigned int cmd,
+				unsigned long arg)
 {
-	if (!demo.membase)
-		return -EIO;
+	struct pci_demo_file *pf = file->private_data;
+	u32 __user *argp = (u32 __user *)arg;
+	u32 flags;
 
-	if (count > demo.memlen)
-		count = demo.memlen;
+	switch (cmd) {
+	case PCI_DEMO_IOC_GET_FLAGS:
+		return put_user(pf->flags, argp);
+	case PCI_DEMO_IOC_SET_FLAGS:
+		if (get_user(flags, argp))
+			return -EFAULT;
+		if ((flags & ~PCI_DEMO_F_ALL) ||
+		    (flags & PCI_DEMO_F_PIO && flags & PCI_DEMO_F_DMA))
+			return -EINVAL;
+		pf->flags = flags;
+		return 0;
+	default:
+		return -ENOTTY;
+	}
+}
 
-	if (dma_enabled)
-		dma_copy(count);
-	else
-		memcpy(dma_buf, demo.membase, count);
 
-	if (copy_to_user(buf, dma_buf, count))
-		return -EFAULT;
-	return count;
+#define PCI_DEMO_STAT_ATTR(name)					\
+static ssize_t name##_show(struct device *dev,				\
+			   struct device_attribute *attr, char *buf)	\
+{									\
+	return sysfs_emit(buf, "%ld\n", atomic_long_read(&name));	\
+}									\
+static DEVICE_ATTR_RO(name)
+
+PCI_DEMO_STAT_ATTR(ra_hits);
+PCI_DEMO_STAT_ATTR(ra_misses);
+PCI_DEMO_STAT_ATTR(ra_issued);
+PCI_DEMO_STAT_ATTR(ra_wasted);
+PCI_DEMO_STAT_ATTR(dma_descs);
+PCI_DEMO_STAT_ATTR(dma_irqs);
+PCI_DEMO_STAT_ATTR(dma_coalesced);
+PCI_DEMO_STAT_ATTR(dma_timer_reaped);
+
+static ssize_t coal_frames_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%u\n", READ_ONCE(coal.frames));
+}
+static DEVICE_ATTR_RO(coal_frames);
+
+static ssize_t pool_slot_size_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct pci_demo_pool *p = pool_get();
+	ssize_t ret = sysfs_emit(buf, "%u\n", p ? p->slot_size : 0);
+
+	if (p)
+		pool_put(p);
+	return ret;
+}
+
+static ssize_t pool_slot_size_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+	struct pci_demo_pool *p = pool_get();
+	unsigned int val;
+	int ret;
+
+	if (!p)
+		return -ENODEV;
+	ret = kstrtouint(buf, 0, &val);
+	if (!ret)
+		ret = pool_resize(val, p->nr_slots);
+	pool_put(p);
+	return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(pool_slot_size);
+
+static ssize_t pool_slots_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct pci_demo_pool *p = pool_get();
+	ssize_t ret = sysfs_emit(buf, "%u\n", p ? p->nr_slots : 0);
+
+	if (p)
+		pool_put(p);
+	return ret;
+}
+
+static ssize_t pool_slots_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+	struct pci_demo_pool *p = pool_get();
+	unsigned int val;
+	int ret;
+
+	if (!p)
+		return -ENODEV;
+	ret = kstrtouint(buf, 0, &val);
+	if (!ret)
+		ret = pool_resize(p->slot_size, val);
+	pool_put(p);
+	return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(pool_slots);
+
+static ssize_t calibration_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct cal_entry *e;
+	unsigned int b;
+	int len;
+
+	if (!READ_ONCE(cal_valid))
+		return sysfs_emit(buf, "not calibrated\n");
+
+	mutex_lock(&cal_mutex);
+	len = sysfs_emit(buf, "size pio_ns dma_ns dma_pipe_ns method\n");
+	for (b = 0; b < CAL_BUCKETS; b++) {
+		e = &cal_table[b];
+		len += sysfs_emit_at(buf, len, "%u %llu %llu %llu %s\n",
+				512 << b, e->ns[XFER_PIO], e->ns[XFER_DMA],
+				e->ns[XFER_DMA_PIPE], xfer_method_names[e->method]);
+	}
+	mutex_unlock(&cal_mutex);
+	return len;
+}
+static DEVICE_ATTR_RO(calibration);
+
+static ssize_t calibrate_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+	int ret = pci_demo_calibrate();
+
+	return ret ? ret : count;
+}
+static DEVICE_ATTR_WO(calibrate);
+
+static struct attribute *pci_demo_attrs[] = {
+	&dev_attr_calibration.attr,
+	&dev_attr_calibrate.attr,
+	&dev_attr_pool_slot_size.attr,
+	&dev_attr_pool_slots.attr,
+	&dev_attr_ra_hits.attr,
+	&dev_attr_ra_misses.attr,
+	&dev_attr_ra_issued.attr,
+	&dev_attr_ra_wasted.attr,
+	&dev_attr_dma_descs.attr,
+	&dev_attr_dma_irqs.attr,
+	&dev_attr_dma_coalesced.attr,
+	&dev_attr_dma_timer_reaped.attr,
+	&dev_attr_coal_frames.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(pci_demo);
+
+/* reads honour the file position, seek within BAR0 to sample it again */
+static loff_t pci_demo_llseek(struct file *file, loff_t offset, int whence)
+{
+	return fixed_size_llseek(file, offset, whence, demo.memlen);
 }
 
 static const struct file_operations pci_demo_fops = {
 	.owner		= THIS_MODULE,
 	.open		= pci_demo_open,
-	.write		= pci_demo_write,
-	.read		= pci_demo_read,
-	//.ioctl	= pci_demo_ioctl,
-	//.mmap		= pci_demo_mmap,
-	//.release	= pci_demo_release,
-	.llseek = no_llseek,
+	.write_iter	= pci_demo_write_iter,
+	.read_iter	= pci_demo_read_iter,
+	.splice_read	= pci_demo_splice_read,
+	.splice_write	= iter_file_splice_write,
+	.unlocked_ioctl	= pci_demo_ioctl,
+	.compat_ioctl	= compat_ptr_ioctl,
+	.mmap		= pci_demo_mmap,
+	.poll		= pci_demo_poll,
+	.fasync		= pci_demo_fasync,
+	.release	= pci_demo_release,
+	.llseek		= pci_demo_llseek,
 };
 
+/* the engine only reads BAR0, map its bus address range as a whole */
+static int pci_demo_dma_init(void)
+{
+	dma_cap_mask_t mask;
+	struct device *dev;
+
+	/* keep one channel for the lifetime of the device */
+	dma_cap_zero(mask);
+	dma_cap_set(DMA_MEMCPY, mask);
+	dma_chan = dma_request_channel(mask, NULL, NULL);
+	if (!dma_chan) {
+		printk(KERN_ERR"pci-demo: dma channel request failed.\n");
+		return -ENODEV;
+	}
+	dev = dma_chan->device->dev;
+	coal.can_kick = dma_has_cap(DMA_INTERRUPT, dma_chan->device->cap_mask);
+
+	/*
+	 * Mappings are made for the engine, which is the bus master here.
+	 * dma_map_resource() gives the whole BAR one contiguous IOVA range,
+	 * so the IOMMU can back it with its largest page sizes.
+	 */
+	src_phys = dma_map_resource(dev, demo.memaddr, demo.memlen,
+					DMA_TO_DEVICE, 0);
+	if (dma_mapping_error(dev, src_phys)) {
+		printk(KERN_ERR"pci-demo: cannot map BAR0 for dma.\n");
+		dma_release_channel(dma_chan);
+		dma_chan = NULL;
+		return -EIO;
+	}
+
+	dma_dev = dev;
+	return 0;
+}
+
+static void pci_demo_dma_exit(void)
+{
+	if (!dma_chan)
+		return;
+	/* the coalescing timer may have left an interrupt descriptor queued */
+	dmaengine_terminate_sync(dma_chan);
+	dma_unmap_resource(dma_dev, src_phys, demo.memlen, DMA_TO_DEVICE, 0);
+	dma_release_channel(dma_chan);
+	dma_chan = NULL;
+	dma_dev = NULL;
+}
+
+/* everything but BAR0 itself, shared by the PCI device and the fake BAR */
+static int pci_demo_setup(struct device *parent)
+{
+	coal_init();
+	if (demo.fake) {
+		if (fake_dma && !soft_dma_start()) {
+			dma_enabled = 1;
+			printk(KERN_INFO"pci-demo: software dma enabled, %u MB/s, %u us\n",
+					fake_dma_mbps, fake_dma_lat_us);
+		}
+	} else if (!pci_demo_dma_init()) {
+		dma_enabled = 1;
+	}
+
+	if (dma_dev)
+		printk(KERN_INFO"pci-demo: dma enabled, BAR0 at %pad\n", &src_phys);
+
+	/* the bounce buffers are used by the memcpy path as well */
+	if (pool_resize(pool_slot_size, pool_slots)) {
+		printk(KERN_ERR"pci-demo: cannot allocate bounce buffers.\n");
+		goto fail;
+	}
+
+	if (calibrate && dma_enabled && pci_demo_calibrate())
+		printk(KERN_ERR"pci-demo: calibration failed, always using dma.\n");
+
+	if (register_chrdev(DEVMAJOR, DEVNAME, &pci_demo_fops)) {
+		pool_destroy();
+		printk(KERN_ERR"pci-demo: cannot register char device.\n");
+		goto fail;
+	}
+
+	if (ring_alloc())
+		printk(KERN_ERR"pci-demo: cannot allocate capture ring.\n");
+
+	/* /sys/class/pci-demo/pci-demo holds statistics and tunables */
+	demo.class = class_create(DEVNAME);
+	if (IS_ERR(demo.class)) {
+		demo.class = NULL;
+	} else {
+		demo.device = device_create_with_groups(demo.class, parent,
+					MKDEV(DEVMAJOR, 0), NULL,
+					pci_demo_groups, DEVNAME);
+		if (IS_ERR(demo.device))
+			demo.device = NULL;
+	}
+	if (!demo.device)
+		printk(KERN_ERR"pci-demo: cannot create sysfs device.\n");
+
+	return 0;
+
+fail:
+	hrtimer_cancel(&coal.timer);
+	soft_dma_stop();
+	pci_demo_dma_exit();
+	dma_enabled = 0;
+	return -ENOMEM;
+}
+
+static void pci_demo_teardown(void)
+{
+	if (demo.device)
+		device_destroy(demo.class, MKDEV(DEVMAJOR, 0));
+	if (demo.class)
+		class_destroy(demo.class);
+	unregister_chrdev(DEVMAJOR, DEVNAME);
+	mutex_lock(&ring.lock);
+	if (ring.thread) {
+		kthread_stop(ring.thread);
+		ring.thread = NULL;
+	}
+	/* pages still mapped in userspace are freed by the last munmap */
+	ring_unmap_dma();
+	ring.dead = true;
+	if (!ring.users)
+		ring_free();
+	mutex_unlock(&ring.lock);
+
+	/* wait for queued reads to give their slots back */
+	pool_destroy();
+	hrtimer_cancel(&coal.timer);
+	soft_dma_stop();
+	pci_demo_dma_exit();
+	dma_enabled = 0;
+}
+
 static int __init pci_demo_probe(struct pci_dev *pci_dev, const struct pci_device_id *pci_id)
 {
+	int ret;
+
 	if (pci_enable_device(pci_dev))
 		return -EIO;
 
@@ -150,29 +2187,26 @@ static int __init pci_demo_probe(struct pci_dev *pci_dev, const struct pci_devic
 
 	demo.membase = ioremap(demo.memaddr, demo.memlen);
 	if (!demo.membase) {
+		release_mem_region(demo.memaddr, demo.memlen);
 		pci_disable_device(pci_dev);
 		printk(KERN_ERR"pci-demo: ioremap failed.\n");
 		return -EIO;
 	}
 
-	if (register_chrdev(DEVMAJOR, DEVNAME, &pci_demo_fops)) {
+	pci_set_master(pci_dev);
+	if (dma_set_mask_and_coherent(&pci_dev->dev, DMA_BIT_MASK(64)) &&
+	    dma_set_mask_and_coherent(&pci_dev->dev, DMA_BIT_MASK(32)))
+		printk(KERN_ERR"pci-demo: no usable dma mask.\n");
+
+	ret = pci_demo_setup(&pci_dev->dev);
+	if (ret) {
 		iounmap(demo.membase);
+		demo.membase = NULL;
+		release_mem_region(demo.memaddr, demo.memlen);
 		pci_disable_device(pci_dev);
-		printk(KERN_ERR"pci-demo: cannot register char device.\n");
-		return -EIO;
-	}
-
-	dma_buf = dma_alloc_coherent(NULL, BUF_SIZE, &dma_phys, GFP_KERNEL);
-	if (dma_buf) {
-		src_phys = dma_map_single(NULL, demo.membase, demo.memlen, DMA_FROM_DEVICE);
-		if (src_phys) {
-			dma_enabled = 1;
-			printk(KERN_INFO"pci-demo: dma enabled, %#x -> %#x\n",
-					(unsigned int)src_phys, (unsigned int)dma_phys);
-		}
+		return ret;
 	}
 
-	pci_set_master(pci_dev);
 	pci_set_drvdata(pci_dev, &demo);
 	printk(KERN_INFO"pci-demo: device probed!\n");
 	return 0;
@@ -180,9 +2214,7 @@ static int __init pci_demo_probe(struct pci_dev *pci_dev, const struct pci_devic
 
 static void pci_demo_remove(struct pci_dev *pci_dev)
 {
-	unregister_chrdev(DEVMAJOR, DEVNAME);
-	dma_free_coherent(NULL, BUF_SIZE, dma_buf, dma_phys);
-	dma_unmap_single(NULL, src_phys, demo.memlen, DMA_FROM_DEVICE);
+	pci_demo_teardown();
 	if (demo.membase) {
 		iounmap(demo.membase);
 		release_mem_region(demo.memaddr, demo.memlen);
@@ -191,6 +2223,35 @@ static void pci_demo_remove(struct pci_dev *pci_dev)
 	printk(KERN_INFO"pci-demo: device removed!\n");
 }
 
+static int __init pci_demo_fake_init(void)
+{
+	unsigned long i;
+	u32 *mem;
+	int ret;
+
+	fake_bar = PAGE_ALIGN(fake_bar);
+	mem = vmalloc(fake_bar);
+	if (!mem)
+		return -ENOMEM;
+
+	/* every word holds its own offset, so readers can check the data */
+	for (i = 0; i < fake_bar / sizeof(*mem); i++)
+		mem[i] = i * sizeof(*mem);
+
+	demo.fake = 1;
+	demo.membase = (void __iomem *)mem;
+	demo.memlen = fake_bar;
+
+	ret = pci_demo_setup(NULL);
+	if (ret) {
+		vfree(mem);
+		return ret;
+	}
+
+	printk(KERN_INFO"pci-demo: using a fake BAR of %lu bytes\n", fake_bar);
+	return 0;
+}
+
 
 #define PCI_VENDOR_ID_DEMO	0x1234
 #define PCI_DEVICE_ID_DEMO	0x4567
@@ -214,11 +2275,18 @@ static int __init pci_demo_init(void)
 	printk("#################################################\n");
 	printk(KERN_INFO"pci-demo: register driver\n");
 	memset(&demo, 0, sizeof(demo));
+	if (fake_bar)
+		return pci_demo_fake_init();
 	return pci_register_driver(&pci_demo_driver);
 }
 
 static void __exit pci_demo_exit(void)
 {
+	if (demo.fake) {
+		pci_demo_teardown();
+		vfree((void __force *)demo.membase);
+		return;
+	}
 	pci_unregister_driver(&pci_demo_driver);
 }
 
@@ -228,4 +2296,3 @@ module_exit(pci_demo_exit);
 MODULE_AUTHOR("Li Xiaobo <lixiaobo@newbeiyang.com>");
 MODULE_DESCRIPTION("PCI Demo Driver");
 MODULE_LICENSE("GPL");
-
@@ -20,6 +20,7 @@
 #include <linux/pci.h>
 #include <asm/uaccess.h>
 #include <asm/io.h>
+#include <linux/uio.h>
 
 #define DEVNAME		"pci-demo"
 #define DEVMAJOR	224
@@ -35,39 +36,57 @@ static struct pci_demo_dev demo;
 
 static int pci_demo_open(struct inode * inode, struct file * file)
 {
+	file->f_mode |= FMODE_NOWAIT;
 	return 0;
 }
 
-static ssize_t pci_demo_write(struct file *file, const char __user *buf,
-				size_t count, loff_t *ppos)
+static ssize_t pci_demo_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
-	printk("pci-demo: got %ld bytes\n", count);
+	size_t count = iov_iter_count(from);
+
+	printk("pci-demo: got %zu bytes\n", count);
+	iov_iter_advance(from, count);
 	return count;
 }
 
-static ssize_t pci_demo_read(struct file * file, char __user * buf,
-				size_t count, loff_t *ppos)
+/* plain memory reads never block, so IOCB_NOWAIT needs no special care */
+static ssize_t pci_demo_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
+	size_t count = iov_iter_count(to);
+	size_t copied;
+
 	if (!demo.membase)
 		return -EIO;
 
-	if (count > demo.memlen)
-		count = demo.memlen;
+	if (iocb->ki_pos >= demo.memlen || !count)
+		return 0;
+	count = min_t(size_t, count, demo.memlen - iocb->ki_pos);
 
-	if (copy_to_user(buf, demo.membase, count))
+	copied = copy_to_iter((void __force *)demo.membase + iocb->ki_pos,
+				count, to);
+	if (!copied)
 		return -EFAULT;
-	return count;
+	iocb->ki_pos += copied;
+	return copied;
+}
+
+/* reads honour the file position, seek within BAR0 to sample it again */
+static loff_t pci_demo_llseek(struct file *file, loff_t offset, int whence)
+{
+	return fixed_size_llseek(file, offset, whence, demo.memlen);
 }
 
 static const struct file_operations pci_demo_fops = {
 	.owner		= THIS_MODULE,
 	.open		= pci_demo_open,
-	.write		= pci_demo_write,
-	.read		= pci_demo_read,
+	.write_iter	= pci_demo_write_iter,
+	.read_iter	= pci_demo_read_iter,
+	.splice_read	= copy_splice_read,
+	.splice_write	= iter_file_splice_write,
 	//.ioctl	= pci_demo_ioctl,
 	//.mmap		= pci_demo_mmap,
 	//.release	= pci_demo_release,
-	.llseek = no_llseek,
+	.llseek		= pci_demo_llseek,
 };
 
 static int __init pci_demo_probe(struct pci_dev *pci_dev, const struct pci_device_id *pci_id)
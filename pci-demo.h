@@ -0,0 +1,64 @@
+/*
+ * pci-demo.h
+ *
+ * Interface shared by the pci-demo driver and user space
+ *
+ */
+
+#ifndef _PCI_DEMO_H
+#define _PCI_DEMO_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/* per file flags, see PCI_DEMO_IOC_SET_FLAGS */
+#define PCI_DEMO_F_POLL		(1 << 0)	/* busy poll DMA completions */
+#define PCI_DEMO_F_PIO		(1 << 1)	/* always read with memcpy */
+#define PCI_DEMO_F_DMA		(1 << 2)	/* always read with DMA */
+#define PCI_DEMO_F_ALL		(PCI_DEMO_F_POLL | PCI_DEMO_F_PIO | \
+				 PCI_DEMO_F_DMA)
+
+#define PCI_DEMO_IOC_MAGIC	'p'
+#define PCI_DEMO_IOC_GET_FLAGS	_IOR(PCI_DEMO_IOC_MAGIC, 1, __u32)
+#define PCI_DEMO_IOC_SET_FLAGS	_IOW(PCI_DEMO_IOC_MAGIC, 2, __u32)
+
+/*
+ * Capture ring, mapped at offset 0 of /dev/pci-demo.
+ *
+ * The mapping starts with struct pci_demo_ring_hdr and one descriptor per
+ * slot, the slot data follows at data_offset, slot_size bytes per slot.
+ * head and tail are free running, slot i lives at index i & (nr_slots - 1).
+ * The driver fills slots and advances head; the consumer processes the
+ * slots between tail and head in place and then stores the new tail.
+ * When the ring is full the driver drops data and counts it in drops.
+ * The mapping may be shorter than the ring, e.g. one page to read the header.
+ */
+#define PCI_DEMO_RING_MAGIC	0x50434952	/* "PCIR" */
+
+struct pci_demo_ring_slot {
+	__u64 pos;		/* BAR0 offset the data was read from */
+	__u64 tstamp;		/* CLOCK_MONOTONIC ns when the slot was filled */
+	__u32 len;
+	__u32 seq;
+};
+
+struct pci_demo_ring_hdr {
+	__u32 magic;
+	__u32 nr_slots;
+	__u32 slot_size;
+	__u32 data_offset;
+	__u64 drops;
+	__u8 pad0[40];
+
+	/* written by the driver only, own cache line */
+	__u32 head;
+	__u8 pad1[60];
+
+	/* written by the consumer only, own cache line */
+	__u32 tail;
+	__u8 pad2[60];
+
+	struct pci_demo_ring_slot slots[];
+};
+
+#endif /* _PCI_DEMO_H */